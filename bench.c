@@ -0,0 +1,340 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2007, 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef ALLINONE
+#include <stdlib.h>       /* exit(), malloc() */
+#include <sys/types.h>    /* off_t */
+#include <string.h>       /* memset(), memcmp(), strerror() */
+#include <stdio.h>        /* printf() etc. */
+#include <unistd.h>       /* read(), close() */
+#include <inttypes.h>     /* uint64_t etc. */
+#include <sys/time.h>     /* gettimeofday() */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA1() etc. */
+#else
+#include "sha1.h"
+#endif
+#ifdef USE_PTHREADS
+#include <pthread.h>      /* pthread_create(), pthread_join() */
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h> /* struct perf_event_attr */
+#include <sys/syscall.h>  /* syscall(), SYS_perf_event_open */
+#endif
+
+#include "mktorrent.h"
+
+#define EXPORT
+#endif /* ALLINONE */
+
+#define BENCH_MIN    15         /* piece lengths to try by default */
+#define BENCH_MAX    24
+#define BENCH_RUN    200000     /* usecs to hash every combination for */
+#define BENCH_CHUNK  (256 << 10) /* bytes to feed SHA1_Update() at once */
+
+/*
+ * the test vectors of FIPS PUB 180-1, as in the self test of sha1.c.
+ * the last one is a million repetitions of "a"
+ */
+static const char *vector_data[] = {
+	"abc",
+	"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+	NULL
+};
+static const unsigned char vector_digests[][SHA_DIGEST_LENGTH] = {
+	{ 0xA9, 0x99, 0x3E, 0x36, 0x47, 0x06, 0x81, 0x6A, 0xBA, 0x3E,
+	  0x25, 0x71, 0x78, 0x50, 0xC2, 0x6C, 0x9C, 0xD0, 0xD8, 0x9D },
+	{ 0x84, 0x98, 0x3E, 0x44, 0x1C, 0x3B, 0xD2, 0x6E, 0xBA, 0xAE,
+	  0x4A, 0xA1, 0xF9, 0x51, 0x29, 0xE5, 0xE5, 0x46, 0x70, 0xF1 },
+	{ 0x34, 0xAA, 0x97, 0x3C, 0xD4, 0xC4, 0xDA, 0xA4, 0xF6, 0x1E,
+	  0xEB, 0x2B, 0xDB, 0xAD, 0x27, 0x31, 0x65, 0x34, 0x01, 0x6F }
+};
+
+/*
+ * one thread hashing pieces over and over
+ */
+struct bench_s;
+typedef struct bench_s bench_t;
+struct bench_s {
+#ifdef USE_PTHREADS
+	pthread_t thread;
+#endif
+	const struct timeval *start;
+	unsigned char *buf;
+	unsigned int piece_length;
+	int one_shot;              /* SHA1() instead of SHA1_Update() */
+	int64_t bytes;             /* bytes hashed */
+	int64_t usec;              /* ..in this long */
+	uint64_t cycles;           /* ..taking this many cycles, 0 if
+	                              we couldn't count them */
+};
+
+static int64_t bench_usec(const struct timeval *start)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (int64_t) (tv.tv_sec - start->tv_sec) * 1000000
+		+ tv.tv_usec - start->tv_usec;
+}
+
+/*
+ * count the cycles of the calling thread, or return -1 if we can't
+ */
+static int open_cycle_counter(void)
+{
+#if defined __linux__ && defined SYS_perf_event_open
+	struct perf_event_attr a;
+
+	memset(&a, 0, sizeof(a));
+	a.type = PERF_TYPE_HARDWARE;
+	a.size = sizeof(a);
+	a.config = PERF_COUNT_HW_CPU_CYCLES;
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+/*
+ * hash a piece the way the workers do, with SHA1(), or the way they
+ * do when hashing a chunk at a time, with SHA1_Update()
+ */
+static void hash_piece(unsigned char *buf, size_t len, int one_shot,
+		unsigned char *digest)
+{
+	SHA_CTX c;
+	size_t n;
+
+	if (one_shot) {
+		SHA1(buf, len, digest);
+		return;
+	}
+
+	SHA1_Init(&c);
+	for (; len; buf += n, len -= n) {
+		n = len < BENCH_CHUNK ? len : BENCH_CHUNK;
+		SHA1_Update(&c, buf, n);
+	}
+	SHA1_Final(digest, &c);
+}
+
+static void *bench_thread(void *data)
+{
+	bench_t *b = data;
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	int fd = open_cycle_counter();
+
+	b->bytes = 0;
+	do {
+		hash_piece(b->buf, b->piece_length, b->one_shot, digest);
+		b->bytes += b->piece_length;
+	} while ((b->usec = bench_usec(b->start)) < BENCH_RUN);
+
+	b->cycles = 0;
+	if (fd >= 0) {
+		if (read(fd, &b->cycles, sizeof(b->cycles))
+				!= sizeof(b->cycles))
+			b->cycles = 0;
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * check the hashes of the test vectors, and that both ways of hashing
+ * a piece agree for every piece length we try. the bundled SHA-1
+ * scribbles on what it hashes, so everything is hashed from a copy
+ */
+static void check_hashes(unsigned int min, unsigned int max)
+{
+	size_t len = (size_t) 1 << max;
+	unsigned char *data = malloc(len > 1000000 ? len : 1000000);
+	unsigned char *copy = malloc(len > 1000000 ? len : 1000000);
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	unsigned char other[SHA_DIGEST_LENGTH];
+	unsigned int i;
+	int one_shot;
+	size_t j;
+
+	if (data == NULL || copy == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (vector_data[i]) {
+			len = strlen(vector_data[i]);
+			memcpy(data, vector_data[i], len);
+		} else {
+			len = 1000000;
+			memset(data, 'a', len);
+		}
+
+		for (one_shot = 0; one_shot < 2; one_shot++) {
+			memcpy(copy, data, len);
+			hash_piece(copy, len, one_shot, digest);
+			if (memcmp(digest, vector_digests[i],
+						SHA_DIGEST_LENGTH)) {
+				fprintf(stderr, "SHA-1 gets test vector %u "
+					"wrong with %s.\n", i + 1,
+					one_shot ? "SHA1()" : "SHA1_Update()");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	for (i = min; i <= max; i++) {
+		len = (size_t) 1 << i;
+		for (j = 0; j < len; j++)
+			data[j] = (unsigned char) (j * 2654435761U >> 24);
+
+		memcpy(copy, data, len);
+		hash_piece(copy, len, 1, digest);
+		memcpy(copy, data, len);
+		hash_piece(copy, len, 0, other);
+		if (memcmp(digest, other, SHA_DIGEST_LENGTH)) {
+			fprintf(stderr, "SHA1() and SHA1_Update() disagree "
+				"on a piece of %lu bytes.\n",
+				(unsigned long) len);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(data);
+	free(copy);
+}
+
+/*
+ * hash pieces of piece_length bytes in the given number of threads for
+ * a while, and print how fast that went
+ */
+static void bench_run(bench_t *b, unsigned int threads,
+		unsigned int piece_length, int one_shot)
+{
+	struct timeval start;
+	int64_t bytes = 0;
+	int64_t usec = 0;
+	uint64_t cycles = 0;
+	int counted = 1;           /* whether every thread counted cycles */
+	unsigned int i;
+#ifdef USE_PTHREADS
+	int err;
+#endif
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < threads; i++) {
+		b[i].start = &start;
+		b[i].piece_length = piece_length;
+		b[i].one_shot = one_shot;
+#ifdef USE_PTHREADS
+		err = pthread_create(&b[i].thread, NULL, bench_thread, b + i);
+		if (err) {
+			fprintf(stderr, "Error creating thread: %s\n",
+					strerror(err));
+			exit(EXIT_FAILURE);
+		}
+#else
+		bench_thread(b + i);
+#endif
+	}
+
+	for (i = 0; i < threads; i++) {
+#ifdef USE_PTHREADS
+		pthread_join(b[i].thread, NULL);
+#endif
+		bytes += b[i].bytes;
+		if (b[i].usec > usec)
+			usec = b[i].usec;
+		cycles += b[i].cycles;
+		if (b[i].cycles == 0)
+			counted = 0;
+	}
+
+	printf("%12u %7u  %-13s %7.2f GB/s", piece_length, threads,
+			one_shot ? "SHA1()" : "SHA1_Update()",
+			bytes / (usec * 1e3));
+	if (counted)
+		printf("  %6.2f cycles/byte\n", (double) cycles / bytes);
+	else
+		printf("  %6s cycles/byte\n", "-");
+	fflush(stdout);
+}
+
+/*
+ * check the SHA-1 we were built with against the test vectors and
+ * measure how fast it hashes pieces of every piece length, or the one
+ * given, in 1, 2, 4 and so on up to the number of threads we'd use
+ */
+EXPORT void bench(metafile_t *m)
+{
+	unsigned int min = BENCH_MIN, max = BENCH_MAX;
+	unsigned int threads = 1;
+	unsigned int i, n, l;
+	bench_t *b;
+
+#ifdef USE_PTHREADS
+	threads = m->threads;
+#endif
+	if (m->piece_length)
+		min = max = m->piece_length;
+
+#ifdef USE_OPENSSL
+	printf("SHA-1:        OpenSSL\n");
+#else
+	printf("SHA-1:        bundled\n");
+#endif
+	printf("Test vectors: ");
+	fflush(stdout);
+	check_hashes(min, max);
+	printf("OK\n\n");
+
+	b = calloc(threads, sizeof(bench_t));
+	if (b == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < threads; i++) {
+		b[i].buf = malloc((size_t) 1 << max);
+		if (b[i].buf == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(b[i].buf, 0x5a, (size_t) 1 << max);
+	}
+
+	printf("Piece length Threads  Hashed with    Throughput\n");
+	for (l = min; l <= max; l++)
+		for (n = 1; ; n *= 2) {
+			if (n > threads)
+				n = threads;
+			bench_run(b, n, 1U << l, 1);
+			bench_run(b, n, 1U << l, 0);
+			if (n == threads)
+				break;
+		}
+
+	for (i = 0; i < threads; i++)
+		free(b[i].buf);
+	free(b);
+}
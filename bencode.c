@@ -0,0 +1,237 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2007, 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef ALLINONE
+#include <sys/types.h>    /* size_t */
+#include <string.h>       /* strlen(), memcmp() */
+#include <ctype.h>        /* isdigit() */
+#include <inttypes.h>     /* int64_t, INT64_MAX */
+
+#define EXPORT
+#endif /* ALLINONE */
+
+#include "bencode.h"
+
+/*
+ * the decoder never copies anything or allocates memory. values are
+ * spans of the buffer they were read from, and lists and dictionaries
+ * are walked by skipping over one value at a time
+ */
+
+/*
+ * parse the length prefix of a string of at most len bytes at p.
+ * returns the length of the prefix including the colon and sets *n
+ * to the length of the string, or returns 0 if it isn't a string
+ */
+static size_t string_header(const char *p, size_t len, size_t *n)
+{
+	size_t i;
+
+	*n = 0;
+	/* no leading zeros */
+	if (len < 2 || (p[0] == '0' && p[1] != ':'))
+		return 0;
+
+	for (i = 0; i < len && isdigit((unsigned char) p[i]); i++) {
+		if (*n > ((size_t) -1 - 9) / 10)
+			return 0;
+		*n = 10 * *n + p[i] - '0';
+	}
+
+	if (i == 0 || i == len || p[i] != ':')
+		return 0;
+	i++;
+
+	if (*n > len - i)
+		return 0;
+
+	return i;
+}
+
+/*
+ * return the length of the integer of at most len bytes at p,
+ * or 0 if it isn't a valid integer
+ */
+static size_t int_length(const char *p, size_t len)
+{
+	size_t i = 1;
+
+	if (i < len && p[i] == '-')
+		i++;
+	if (i == len || !isdigit((unsigned char) p[i]))
+		return 0;
+	/* no leading zeros and no negative zero */
+	if (p[i] == '0' && (i > 1 || (i + 1 < len && p[i + 1] != 'e')))
+		return 0;
+
+	while (i < len && isdigit((unsigned char) p[i]))
+		i++;
+	if (i == len || p[i] != 'e')
+		return 0;
+
+	return i + 1;
+}
+
+/*
+ * return the length of the bencoded value at the start of the len
+ * bytes at p, or 0 if it is malformed or doesn't end within them
+ */
+EXPORT size_t bencode_skip(const char *p, size_t len)
+{
+	size_t i = 0;
+	unsigned long depth = 0;   /* lists and dictionaries we're in */
+	size_t n, h;
+
+	do {
+		if (i == len)
+			return 0;
+
+		switch (p[i]) {
+		case 'i':
+			n = int_length(p + i, len - i);
+			if (n == 0)
+				return 0;
+			i += n;
+			break;
+		case 'l':
+		case 'd':
+			depth++;
+			i++;
+			break;
+		case 'e':
+			if (depth == 0)
+				return 0;
+			depth--;
+			i++;
+			break;
+		default:
+			h = string_header(p + i, len - i, &n);
+			if (h == 0)
+				return 0;
+			i += h + n;
+		}
+	} while (depth);
+
+	return i;
+}
+
+/*
+ * set *items to the contents of the list (type 'l') or dictionary
+ * (type 'd') v. returns 0 if v is something else
+ */
+EXPORT int bencode_first(bspan_t v, char type, bspan_t *items)
+{
+	if (v.len < 2 || v.p[0] != type || v.p[v.len - 1] != 'e')
+		return 0;
+
+	items->p = v.p + 1;
+	items->len = v.len - 2;
+	return 1;
+}
+
+/*
+ * take the next value off the contents of a list or dictionary.
+ * returns 0 when there are no more
+ */
+EXPORT int bencode_next(bspan_t *items, bspan_t *item)
+{
+	size_t n;
+
+	if (items->len == 0)
+		return 0;
+
+	n = bencode_skip(items->p, items->len);
+	if (n == 0)
+		return 0;
+
+	item->p = items->p;
+	item->len = n;
+	items->p += n;
+	items->len -= n;
+	return 1;
+}
+
+/*
+ * set *s to the contents of the string v. returns 0 if v isn't a string
+ */
+EXPORT int bencode_string(bspan_t v, bspan_t *s)
+{
+	size_t n;
+	size_t h = string_header(v.p, v.len, &n);
+
+	if (h == 0 || h + n != v.len)
+		return 0;
+
+	s->p = v.p + h;
+	s->len = n;
+	return 1;
+}
+
+/*
+ * read the integer v into *i. returns 0 if v isn't an integer
+ * or doesn't fit
+ */
+EXPORT int bencode_int(bspan_t v, int64_t *i)
+{
+	size_t k = 1;
+	int neg = 0;
+
+	if (v.len == 0 || v.p[0] != 'i' || int_length(v.p, v.len) != v.len)
+		return 0;
+
+	if (v.p[k] == '-') {
+		neg = 1;
+		k++;
+	}
+
+	for (*i = 0; v.p[k] != 'e'; k++) {
+		if (*i > (INT64_MAX - 9) / 10)
+			return 0;
+		*i = 10 * *i + v.p[k] - '0';
+	}
+
+	if (neg)
+		*i = -*i;
+	return 1;
+}
+
+/*
+ * compare the contents of a string to a C string
+ */
+EXPORT int bencode_is(bspan_t s, const char *str)
+{
+	return s.len == strlen(str) && memcmp(s.p, str, s.len) == 0;
+}
+
+/*
+ * look up key in the dictionary dict and set *value to its value.
+ * returns 0 if there is no such key
+ */
+EXPORT int bencode_find(bspan_t dict, const char *key, bspan_t *value)
+{
+	bspan_t items, k, s;
+
+	if (!bencode_first(dict, 'd', &items))
+		return 0;
+
+	while (bencode_next(&items, &k) && bencode_next(&items, value))
+		if (bencode_string(k, &s) && bencode_is(s, key))
+			return 1;
+
+	return 0;
+}
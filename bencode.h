@@ -0,0 +1,25 @@
+#ifndef _BENCODE_H
+#define _BENCODE_H
+
+/*
+ * a bencoded value, or the contents of a string, list or dictionary,
+ * pointing into the buffer it was decoded from
+ */
+struct bspan_s;
+typedef struct bspan_s bspan_t;
+struct bspan_s {
+	const char *p;
+	size_t len;
+};
+
+#ifndef ALLINONE
+size_t bencode_skip(const char *p, size_t len);
+int bencode_first(bspan_t v, char type, bspan_t *items);
+int bencode_next(bspan_t *items, bspan_t *item);
+int bencode_string(bspan_t v, bspan_t *s);
+int bencode_int(bspan_t v, int64_t *i);
+int bencode_find(bspan_t dict, const char *key, bspan_t *value);
+int bencode_is(bspan_t s, const char *str);
+#endif /* ALLINONE */
+
+#endif /* _BENCODE_H */
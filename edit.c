@@ -0,0 +1,453 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2007, 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef ALLINONE
+#include <stdlib.h>       /* exit(), malloc() */
+#include <sys/types.h>    /* off_t */
+#include <errno.h>        /* errno */
+#include <string.h>       /* strerror(), memcpy() etc. */
+#include <stdio.h>        /* fopen(), fread() etc. */
+#include <inttypes.h>     /* int64_t */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA_DIGEST_LENGTH */
+#else
+#include "sha1.h"
+#endif
+
+#include "mktorrent.h"
+#include "bencode.h"
+
+#define EXPORT
+#endif /* ALLINONE */
+
+/*
+ * read the whole file at path into memory and return it,
+ * setting *len to its length
+ */
+static char *slurp(const char *path, size_t *len)
+{
+	FILE *f;
+	char *buf = NULL;
+	size_t size = 0;
+	size_t n;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Error opening '%s': %s\n",
+				path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? 2 * size : 65536;
+			buf = realloc(buf, size);
+			if (buf == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		n = fread(buf + *len, 1, size - *len, f);
+		*len += n;
+	} while (n);
+
+	if (ferror(f)) {
+		fprintf(stderr, "Error reading '%s': %s\n",
+				path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+
+	return buf;
+}
+
+static void invalid(const char *path, const char *what)
+{
+	fprintf(stderr, PROGRAM ": '%s' is not a valid metainfo file: %s\n",
+			path, what);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * return a null terminated copy of the bencoded string v
+ */
+static char *read_string(bspan_t v, const char *path, const char *what)
+{
+	bspan_t s;
+	char *r;
+
+	if (!bencode_string(v, &s) || memchr(s.p, '\0', s.len))
+		invalid(path, what);
+
+	r = malloc(s.len + 1);
+	if (r == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(r, s.p, s.len);
+	r[s.len] = '\0';
+
+	return r;
+}
+
+static slist_t *new_slist(char *s)
+{
+	slist_t *l = malloc(sizeof(slist_t));
+
+	if (l == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	l->s = s;
+	l->next = NULL;
+
+	return l;
+}
+
+/*
+ * return a string list of the strings in the list v
+ */
+static slist_t *read_slist(bspan_t v, const char *path, const char *what)
+{
+	slist_t *list = NULL;
+	slist_t **last = &list;
+	bspan_t items, item;
+
+	if (!bencode_first(v, 'l', &items))
+		invalid(path, what);
+
+	while (bencode_next(&items, &item)) {
+		*last = new_slist(read_string(item, path, what));
+		last = &(*last)->next;
+	}
+
+	return list;
+}
+
+/*
+ * return the announce list, a list of lists of URLs, leaving out
+ * empty tiers
+ */
+static llist_t *read_llist(bspan_t v, const char *path)
+{
+	llist_t *list = NULL;
+	llist_t **last = &list;
+	bspan_t tiers, tier;
+	slist_t *l;
+
+	if (!bencode_first(v, 'l', &tiers))
+		invalid(path, "bad announce list");
+
+	while (bencode_next(&tiers, &tier)) {
+		l = read_slist(tier, path, "bad announce list");
+		if (l == NULL)
+			continue;
+
+		*last = malloc(sizeof(llist_t));
+		if (*last == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		(*last)->l = l;
+		(*last)->next = NULL;
+		last = &(*last)->next;
+	}
+
+	return list;
+}
+
+/*
+ * build the file list from the files list of a multi file torrent
+ */
+static flist_t *read_flist(metafile_t *m, bspan_t v, const char *path)
+{
+	flist_t *list = NULL;
+	flist_t **last = &list;
+	flist_t *prev = NULL;
+	bspan_t items, item, x, s;
+
+	if (!bencode_first(v, 'l', &items))
+		invalid(path, "bad file list");
+
+	while (bencode_next(&items, &item)) {
+		slist_t *dirs, *l;
+		int64_t size;
+		size_t len = 0;
+		char *p;
+
+		if (!bencode_find(item, "length", &x)
+				|| !bencode_int(x, &size) || size < 0
+				|| !bencode_find(item, "path", &x))
+			invalid(path, "bad file in file list");
+
+		/* a BEP 47 padding file is zeros following the file
+		   before it, which we write back the same way */
+		if (prev && bencode_find(item, "attr", &s)
+				&& bencode_string(s, &s)
+				&& memchr(s.p, 'p', s.len)) {
+			prev->pad += size;
+			m->size += size;
+			continue;
+		}
+
+		/* join the path components with DIRSEP */
+		dirs = read_slist(x, path, "bad file path");
+		if (dirs == NULL)
+			invalid(path, "empty file path");
+		for (l = dirs; l; l = l->next)
+			len += strlen(l->s) + 1;
+
+		*last = malloc(sizeof(flist_t));
+		p = malloc(len);
+		if (*last == NULL || p == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		(*last)->path = p;
+		for (l = dirs; l; l = l->next) {
+			strcpy(p, l->s);
+			p += strlen(p);
+			if (l->next)
+				*p++ = DIRSEP[0];
+		}
+		(*last)->size = size;
+		(*last)->pad = 0;
+		(*last)->dev = 0;
+		(*last)->ino = 0;
+		(*last)->mtime = 0;
+		(*last)->ctime = 0;
+		(*last)->mtime_nsec = 0;
+		(*last)->ctime_nsec = 0;
+		(*last)->sparse = 0;
+		(*last)->offset = 0;
+		(*last)->error = 0;
+		(*last)->changed = 0;
+		(*last)->next = NULL;
+		prev = *last;
+		last = &(*last)->next;
+
+		m->size += size;
+	}
+
+	return list;
+}
+
+/*
+ * keep an info dictionary field we don't know about as it is, unless
+ * the user gave one with the same key. the extra list is kept sorted
+ */
+static void keep_extra(metafile_t *m, bspan_t key, bspan_t value,
+		const char *path)
+{
+	elist_t **e = &m->extra;
+	elist_t *n;
+	char *k = read_string(key, path, "bad info key");
+
+	while (*e && strcmp((*e)->key, k) < 0)
+		e = &(*e)->next;
+	if (*e && strcmp((*e)->key, k) == 0) {
+		free(k);
+		return;
+	}
+
+	n = malloc(sizeof(elist_t));
+	if (n == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	n->key = k;
+	n->value = (char *) value.p;
+	n->raw_len = value.len;
+	n->next = *e;
+	*e = n;
+}
+
+/*
+ * read everything but the pieces from the info dictionary
+ */
+static void read_info(metafile_t *m, bspan_t info, const char *path)
+{
+	bspan_t items, key, value, s;
+	int64_t i;
+
+	if (!bencode_first(info, 'd', &items))
+		invalid(path, "no info dictionary");
+
+	while (bencode_next(&items, &key) && bencode_next(&items, &value)) {
+		if (!bencode_string(key, &s))
+			invalid(path, "bad info key");
+
+		if (bencode_is(s, "files")) {
+			m->target_is_directory = 1;
+			m->file_list = read_flist(m, value, path);
+		} else if (bencode_is(s, "length")) {
+			if (!bencode_int(value, &i) || i < 0)
+				invalid(path, "bad length");
+			m->size = i;
+		} else if (bencode_is(s, "name")) {
+			if (m->torrent_name == NULL)
+				m->torrent_name =
+					read_string(value, path, "bad name");
+		} else if (bencode_is(s, "piece length")) {
+			if (!bencode_int(value, &i) || i <= 0 || i > 1 << 30)
+				invalid(path, "bad piece length");
+			m->piece_length = i;
+		} else if (bencode_is(s, "pieces")) {
+			if (!bencode_string(value, &s)
+					|| s.len % SHA_DIGEST_LENGTH)
+				invalid(path, "bad pieces");
+			m->hash_string = (unsigned char *) s.p;
+			m->pieces = s.len / SHA_DIGEST_LENGTH;
+		} else if (bencode_is(s, "private")) {
+			/* an explicit -p or -u wins */
+			if (m->private == 0 && bencode_int(value, &i) && i == 1)
+				m->private = 1;
+		} else
+			keep_extra(m, key, value, path);
+	}
+}
+
+/*
+ * read the metainfo file at path and fill out m with everything in it
+ * we haven't been given on the command line, so it can be written out
+ * again with the pieces copied byte for byte instead of rehashed
+ */
+EXPORT void read_metainfo(metafile_t *m, const char *path)
+{
+	size_t len;
+	char *buf = slurp(path, &len);
+	bspan_t root = { buf, len };
+	bspan_t items, key, value, s;
+	char *name = NULL;
+	unsigned char *copy;
+	SHA_CTX c;
+
+	if (bencode_skip(buf, len) != len)
+		invalid(path, "bad bencoding");
+	if (!bencode_find(root, "info", &value))
+		invalid(path, "no info dictionary");
+
+	/* hash a copy of the info section, as our own SHA1_Update()
+	   scribbles on the data it hashes */
+	copy = malloc(value.len);
+	if (copy == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(copy, value.p, value.len);
+	SHA1_Init(&c);
+	SHA1_Update(&c, copy, value.len);
+	SHA1_Final(m->old_infohash, &c);
+	free(copy);
+
+	/* a single file torrent is named after the file */
+	if (bencode_find(value, "name", &s))
+		name = read_string(s, path, "bad name");
+	read_info(m, value, path);
+
+	if (m->piece_length == 0 || m->hash_string == NULL || name == NULL
+			|| (!m->target_is_directory
+				&& !bencode_find(value, "length", &s)))
+		invalid(path, "incomplete info dictionary");
+
+	if (!m->target_is_directory) {
+		m->file_list = malloc(sizeof(flist_t));
+		if (m->file_list == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		m->file_list->path = name;
+		m->file_list->size = m->size;
+		m->file_list->pad = 0;
+		m->file_list->dev = 0;
+		m->file_list->ino = 0;
+		m->file_list->mtime = 0;
+		m->file_list->ctime = 0;
+		m->file_list->mtime_nsec = 0;
+		m->file_list->ctime_nsec = 0;
+		m->file_list->sparse = 0;
+		m->file_list->offset = 0;
+		m->file_list->error = 0;
+		m->file_list->changed = 0;
+		m->file_list->next = NULL;
+	}
+
+	if (m->pieces != (m->size + m->piece_length - 1) / m->piece_length)
+		invalid(path, "the number of pieces doesn't match the size");
+
+	/* the URLs given on the command line replace those in the file */
+	if (m->announce_list == NULL
+			&& bencode_find(root, "announce-list", &value))
+		m->announce_list = read_llist(value, path);
+	if (m->announce_list == NULL
+			&& bencode_find(root, "announce", &value)) {
+		m->announce_list = malloc(sizeof(llist_t));
+		if (m->announce_list == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		m->announce_list->l = new_slist(read_string(value,
+					path, "bad announce URL"));
+		m->announce_list->next = NULL;
+	}
+
+	if (m->comment == NULL && bencode_find(root, "comment", &value))
+		m->comment = read_string(value, path, "bad comment");
+
+	if (m->web_seed_list == NULL
+			&& bencode_find(root, "url-list", &value)) {
+		if (value.p[0] == 'l')
+			m->web_seed_list = read_slist(value,
+					path, "bad web seed list");
+		else
+			m->web_seed_list = new_slist(read_string(value,
+						path, "bad web seed"));
+	}
+
+	/* we write the rest ourselves or don't know what it is */
+	bencode_first(root, 'd', &items);
+	while (bencode_next(&items, &key) && bencode_next(&items, &value)) {
+		if (!bencode_string(key, &s))
+			invalid(path, "bad key");
+
+		if (!bencode_is(s, "announce")
+				&& !bencode_is(s, "announce-list")
+				&& !bencode_is(s, "comment")
+				&& !bencode_is(s, "created by")
+				&& !bencode_is(s, "creation date")
+				&& !bencode_is(s, "info")
+				&& !bencode_is(s, "url-list"))
+			fprintf(stderr, "Warning: dropping the '%.*s' field "
+					"of '%s'.\n", (int) s.len, s.p, path);
+	}
+}
+
+/*
+ * compare the infohash of the metainfo file we wrote with that of the
+ * one we read, and warn if it isn't the same torrent to clients anymore
+ */
+EXPORT void check_infohash(metafile_t *m)
+{
+	if (memcmp(m->old_infohash, m->infohash, SHA_DIGEST_LENGTH))
+		fprintf(stderr, "Warning: the info section has changed, so "
+				"the torrent has a new infohash and\n"
+				"clients will see it as a different "
+				"torrent.\n");
+}
@@ -0,0 +1,205 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2007, 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef ALLINONE
+#include <stdlib.h>       /* exit(), malloc() */
+#include <sys/types.h>    /* off_t */
+#include <string.h>       /* memset() */
+#include <stdio.h>        /* printf() etc. */
+#include <fcntl.h>        /* open() */
+#include <unistd.h>       /* read(), lseek(), close() */
+#include <inttypes.h>     /* PRId64 etc. */
+#include <sys/time.h>     /* gettimeofday() */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA1_Update() etc. */
+#else
+#include "sha1.h"
+#endif
+
+#include "mktorrent.h"
+
+#define EXPORT
+
+/* output.c */
+extern size_t write_metainfo(char **out, metafile_t *m,
+		unsigned char *hash_string);
+#endif /* ALLINONE */
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined _LARGEFILE_SOURCE && defined O_LARGEFILE
+#define OPENFLAGS (O_RDONLY | O_BINARY | O_LARGEFILE)
+#else
+#define OPENFLAGS (O_RDONLY | O_BINARY)
+#endif
+
+#define BENCH_USEC   100000     /* time to spend hashing */
+#define BENCH_BLOCK  (1 << 20)  /* bytes to hash at a time */
+#define PROBES       8          /* places of the torrent to read from */
+#define PROBE_BYTES  (1 << 20)  /* ..and how much to read at each */
+
+static int64_t usec_since(const struct timeval *start)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (int64_t) (tv.tv_sec - start->tv_sec) * 1000000
+		+ tv.tv_usec - start->tv_usec;
+}
+
+/*
+ * return the number of bytes one thread hashes per second
+ */
+static double hash_speed()
+{
+	unsigned char *buf = malloc(BENCH_BLOCK);
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	struct timeval start;
+	int64_t usec;
+	int64_t bytes = 0;
+	SHA_CTX c;
+
+	if (buf == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 0x5a, BENCH_BLOCK);
+
+	gettimeofday(&start, NULL);
+	do {
+		SHA1_Init(&c);
+		SHA1_Update(&c, buf, BENCH_BLOCK);
+		SHA1_Final(digest, &c);
+		bytes += BENCH_BLOCK;
+	} while ((usec = usec_since(&start)) < BENCH_USEC);
+
+	free(buf);
+	return bytes * 1e6 / usec;
+}
+
+/*
+ * read a little from evenly spread places of the torrent and return
+ * the bytes read per second. the time spent opening files is added
+ * to *open_usec, so the caller can account for that per file
+ */
+static double read_speed(metafile_t *m, double *open_usec)
+{
+	unsigned char *buf = malloc(PROBE_BYTES);
+	flist_t *f = m->file_list;
+	int64_t file_start = 0;
+	int64_t read_usec = 0;
+	int64_t bytes = 0;
+	unsigned int opened = 0;
+	unsigned int i;
+
+	if (buf == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	*open_usec = 0;
+	for (i = 0; i < PROBES; i++) {
+		int64_t at = m->size / PROBES * i;
+		struct timeval start;
+		ssize_t n;
+		int fd;
+
+		/* find the file holding the byte at offset at */
+		while (f && file_start + f->size + f->pad <= at) {
+			file_start += f->size + f->pad;
+			f = f->next;
+		}
+		if (f == NULL)
+			break;
+
+		gettimeofday(&start, NULL);
+		fd = open(m->tar ? m->tar : f->path, OPENFLAGS);
+		if (fd < 0)
+			continue;
+		*open_usec += usec_since(&start);
+		opened++;
+
+		gettimeofday(&start, NULL);
+		if (lseek(fd, f->offset + at - file_start, SEEK_SET) >= 0) {
+			n = read(fd, buf, PROBE_BYTES);
+			if (n > 0) {
+				read_usec += usec_since(&start);
+				bytes += n;
+			}
+		}
+		close(fd);
+	}
+
+	free(buf);
+	if (opened)
+		*open_usec /= opened;
+
+	return read_usec ? bytes * 1e6 / read_usec : 0;
+}
+
+static void print_duration(double sec)
+{
+	unsigned long s = sec + 0.5;
+
+	printf("%lu:%02lu:%02lu\n", s / 3600, s / 60 % 60, s % 60);
+}
+
+/*
+ * tell what we would do and how long it would take
+ * without hashing anything or writing the metainfo file
+ */
+EXPORT void estimate(metafile_t *m)
+{
+	double hash = hash_speed();
+	double rd, open_usec, files = 0, sec;
+	unsigned int threads = 1;
+	flist_t *f;
+
+	for (f = m->file_list; f; f = f->next)
+		files++;
+
+#ifdef USE_PTHREADS
+	threads = m->threads;
+#endif
+
+	printf("Piece length:   %u bytes\n"
+	       "Pieces:         %u\n"
+	       "Metainfo file:  %lu bytes\n"
+	       "Hashing:        %.1f MiB/s per thread\n",
+	       m->piece_length, m->pieces,
+	       (unsigned long) write_metainfo(NULL, m, NULL),
+	       hash / ONEMEG);
+
+	rd = read_speed(m, &open_usec);
+	if (rd > 0)
+		printf("Reading:        %.1f MiB/s, %.0f us to open a file "
+		       "(sampled, the data may be cached)\n",
+		       rd / ONEMEG, open_usec);
+
+	/* hashing runs alongside reading, so whichever is
+	   slower decides how long it takes */
+	sec = m->size / (hash * threads);
+	if (rd > 0 && m->size / rd + files * open_usec / 1e6 > sec)
+		sec = m->size / rd + files * open_usec / 1e6;
+
+	printf("Estimated time: ");
+	print_duration(sec);
+}
@@ -0,0 +1,253 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef ALLINONE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "mktorrent.h"
+
+#define EXPORT
+#endif /* ALLINONE */
+
+#include "filter.h"
+
+/* how a pattern is matched, worked out when it is added */
+#define PATTERN_GLOB    0  /* with glob_match() */
+#define PATTERN_LITERAL 1  /* it is the name, or the path */
+#define PATTERN_PREFIX  2  /* the name starts with text, text* */
+#define PATTERN_SUFFIX  3  /* the name ends with text, *text */
+
+/*
+ * whether the first len characters of s say more than themselves
+ */
+static int glob_special(const char *s, size_t len)
+{
+	for (; len; s++, len--)
+		if (*s == '*' || *s == '?' || *s == '[' || *s == '\\')
+			return 1;
+
+	return 0;
+}
+
+/*
+ * match c against the class starting at g, just after the [, and set
+ * *end to what follows the ]. returns -1 when there is no ], in which
+ * case the [ is just a [
+ */
+static int glob_class(const char *g, char c, const char **end)
+{
+	int negate = 0;
+	int match = 0;
+
+	if (*g == '!' || *g == '^') {
+		negate = 1;
+		g++;
+	}
+
+	/* a ] first is part of the class */
+	do {
+		unsigned char lo = *g;
+		unsigned char hi;
+
+		if (lo == '\0')
+			return -1;
+		if (lo == '\\' && g[1])
+			lo = *++g;
+		hi = lo;
+		if (g[1] == '-' && g[2] && g[2] != ']') {
+			g += 2;
+			hi = *g;
+			if (hi == '\\' && g[1])
+				hi = *++g;
+		}
+		if ((unsigned char) c >= lo && (unsigned char) c <= hi)
+			match = 1;
+		g++;
+	} while (*g != ']');
+
+	*end = g + 1;
+
+	return c != DIRSEP[0] && match != negate;
+}
+
+/*
+ * match c against what *gp points to, which isn't a * or the end of the
+ * pattern, and move *gp on to what follows it
+ */
+static int glob_one(const char **gp, char c)
+{
+	const char *g = *gp;
+	int r;
+
+	switch (*g) {
+	case '?':
+		*gp = g + 1;
+		return c != DIRSEP[0];
+	case '[':
+		r = glob_class(g + 1, c, gp);
+		if (r >= 0)
+			return r;
+		break;
+	case '\\':
+		if (g[1])
+			g++;
+		break;
+	}
+
+	*gp = g + 1;
+	return *g == c;
+}
+
+/*
+ * whether the characters from s to e match the shell pattern g, where
+ * neither *, ? nor a class matches a directory separator
+ */
+static int glob_match(const char *g, const char *s, const char *e)
+{
+	const char *star_g = NULL;   /* what follows the last * */
+	const char *star_s = NULL;   /* ..and where it stopped matching */
+
+	while (s < e) {
+		if (*g == '*') {
+			while (*g == '*')
+				g++;
+			star_g = g;
+			star_s = s;
+			continue;
+		}
+
+		if (*g && glob_one(&g, *s)) {
+			s++;
+			continue;
+		}
+
+		/* let the last * take one more character,
+		   as long as it isn't a separator */
+		if (star_g == NULL || *star_s == DIRSEP[0])
+			return 0;
+		g = star_g;
+		s = ++star_s;
+	}
+
+	while (*g == '*')
+		g++;
+
+	return *g == '\0';
+}
+
+/*
+ * add the shell pattern glob to list. a pattern with a directory
+ * separator, other than at the end, is matched against the path from
+ * the top, others against the name of a file or directory. most
+ * patterns are a plain name, a *.suffix or a prefix*, which are
+ * matched without going through glob_match()
+ */
+EXPORT void pattern_add(pattern_t **list, const char *glob)
+{
+	pattern_t *p = malloc(sizeof(pattern_t));
+	char *g;
+	size_t len;
+
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* a separator in front says it is a path from the top */
+	p->path = 0;
+	while (*glob == DIRSEP[0]) {
+		p->path = 1;
+		glob++;
+	}
+
+	g = strdup(glob);
+	if (g == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	len = strlen(g);
+	while (len && g[len - 1] == DIRSEP[0])
+		g[--len] = '\0';
+	if (strchr(g, DIRSEP[0]))
+		p->path = 1;
+
+	p->glob = g;
+	p->kind = PATTERN_GLOB;
+	p->text = g;
+	p->len = len;
+
+	if (!glob_special(g, len))
+		p->kind = PATTERN_LITERAL;
+	else if (!p->path && g[0] == '*' && !glob_special(g + 1, len - 1)) {
+		p->kind = PATTERN_SUFFIX;
+		p->text = g + 1;
+		p->len = len - 1;
+	} else if (!p->path && g[len - 1] == '*'
+			&& !glob_special(g, len - 1)) {
+		p->kind = PATTERN_PREFIX;
+		p->len = len - 1;
+	}
+
+	p->next = NULL;
+	while (*list)
+		list = &(*list)->next;
+	*list = p;
+}
+
+/*
+ * whether any pattern in list matches the file or directory at the
+ * first len characters of path, which is the path from the top
+ */
+EXPORT int pattern_match(const pattern_t *list, const char *path, size_t len)
+{
+	const char *end = path + len;
+	const char *name = end;
+	const pattern_t *p;
+
+	while (name > path && name[-1] != DIRSEP[0])
+		name--;
+
+	for (p = list; p; p = p->next) {
+		const char *s = p->path ? path : name;
+		size_t n = end - s;
+
+		switch (p->kind) {
+		case PATTERN_LITERAL:
+			if (n == p->len && memcmp(s, p->text, n) == 0)
+				return 1;
+			break;
+		case PATTERN_PREFIX:
+			if (n >= p->len && memcmp(s, p->text, p->len) == 0)
+				return 1;
+			break;
+		case PATTERN_SUFFIX:
+			if (n >= p->len
+					&& memcmp(end - p->len, p->text, p->len) == 0)
+				return 1;
+			break;
+		default:
+			if (glob_match(p->glob, s, end))
+				return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#ifndef ALLINONE
+void pattern_add(pattern_t **list, const char *glob);
+int pattern_match(const pattern_t *list, const char *path, size_t len);
+#endif /* ALLINONE */
+
+#endif /* _FILTER_H */
@@ -131,7 +131,8 @@ static unsigned int cleanup(struct dir_state *ds, char *path, int ret)
 }
 
 EXPORT int file_tree_walk(const char *dirname, unsigned int nfds,
-		file_tree_walk_cb callback, void *data)
+		file_tree_walk_cb callback, file_tree_walk_skip_cb skip,
+		void *data)
 {
 	size_t path_size = 256;
 	char *path;
@@ -220,6 +221,11 @@ EXPORT int file_tree_walk(const char *dirname, unsigned int nfds,
 				}
 			}
 
+			/* left out, so not stat'ed or, if it is
+			   a directory, opened */
+			if (skip && skip(path, data))
+				continue;
+
 			if (stat(path, &sbuf)) {
 				fprintf(stderr, "Error stat'ing '%s': %s\n",
 						path, strerror(errno));
@@ -4,9 +4,13 @@
 typedef int (*file_tree_walk_cb)(const char *name,
 		const struct stat *sbuf, void *data);
 
+/* whether to leave out a file or directory, asked before stat'ing it */
+typedef int (*file_tree_walk_skip_cb)(const char *name, void *data);
+
 #ifndef ALLINONE
 int file_tree_walk(const char *dirname, unsigned int nfds,
-		file_tree_walk_cb callback, void *data);
+		file_tree_walk_cb callback, file_tree_walk_skip_cb skip,
+		void *data);
 
 #endif /* ALLINONE */
 
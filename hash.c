@@ -19,34 +19,23 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #ifndef ALLINONE
 #include <stdlib.h>       /* exit() */
 #include <sys/types.h>    /* off_t */
-#include <errno.h>        /* errno */
-#include <string.h>       /* strerror() */
 #include <stdio.h>        /* printf() etc. */
-#include <fcntl.h>        /* open() */
-#include <unistd.h>       /* read(), close() */
-#include <inttypes.h>     /* PRId64 etc. */
+#include <inttypes.h>     /* int64_t */
 
 #ifdef USE_OPENSSL
-#include <openssl/sha.h>  /* SHA1() */
+#include <openssl/sha.h>  /* SHA_DIGEST_LENGTH */
 #else
 #include "sha1.h"
 #endif
 
 #include "mktorrent.h"
+#include "prefetch.h"
+#include "reuse.h"
+#include "io.h"
 
 #define EXPORT
 #endif /* ALLINONE */
 
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
-
-#if defined _LARGEFILE_SOURCE && defined O_LARGEFILE
-#define OPENFLAGS (O_RDONLY | O_BINARY | O_LARGEFILE)
-#else
-#define OPENFLAGS (O_RDONLY | O_BINARY)
-#endif
-
 /*
  * go through the files in file_list, split their contents into pieces
  * of size piece_length and create the hash string, which is the
@@ -55,18 +44,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
  */
 EXPORT unsigned char *make_hash(metafile_t *m)
 {
-	flist_t *f;                     /* pointer to a place in the file list */
+	flist_t *f = m->file_list;      /* file the next piece starts in */
+	off_t off = 0;                  /* ..and where in it */
 	unsigned char *hash_string;     /* the hash string */
-	unsigned char *pos;             /* position in the hash string */
 	unsigned char *read_buf;        /* read buffer */
-	int fd;                         /* file descriptor */
-	size_t r;                       /* number of bytes read from file(s) into
-	                                   the read buffer */
-	SHA_CTX c;                      /* SHA1 hashing context */
-#ifndef NO_HASH_CHECK
-	int64_t counter = 0;            /* number of bytes hashed
-	                                   should match size when done */
-#endif
+	unsigned int i;                 /* piece we are at */
+	prefetch_t pf;                  /* files opened ahead */
+	reuse_t ru;                     /* pieces we know the hashes of */
+	source_t s;                     /* where the pieces come from */
+	int64_t reused = 0;             /* bytes of pieces we didn't read */
+	SHA_CTX ctx[MAX_LENGTHS];       /* pieces of the other lengths */
 
 	/* allocate memory for the hash string
 	   every SHA1 hash is SHA_DIGEST_LENGTH (20) bytes long */
@@ -80,76 +67,40 @@ EXPORT unsigned char *make_hash(metafile_t *m)
 		exit(EXIT_FAILURE);
 	}
 
-	/* initiate pos to point to the beginning of hash_string */
-	pos = hash_string;
-	/* and initiate r to 0 since we haven't read anything yet */
-	r = 0;
-	/* go through all the files in the file list */
-	for (f = m->file_list; f; f = f->next) {
-
-		/* open the current file for reading */
-		if ((fd = open(f->path, OPENFLAGS)) == -1) {
-			fprintf(stderr, "Error opening '%s' for reading: %s\n",
-					f->path, strerror(errno));
-			exit(EXIT_FAILURE);
-		}
-		printf("Hashing %s.\n", f->path);
-		fflush(stdout);
-
-		/* fill the read buffer with the contents of the file and append
-		   the SHA1 hash of it to the hash string when the buffer is full.
-		   repeat until we can't fill the read buffer and we've thus come
-		   to the end of the file */
-		while (1) {
-			ssize_t d = read(fd, read_buf + r, m->piece_length - r);
-
-			if (d < 0) {
-				fprintf(stderr, "Error reading from '%s': %s\n",
-						f->path, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-
-			if (d == 0) /* end of file */
-				break;
-
-			r += d;
-
-			if (r == m->piece_length) {
-				SHA1_Init(&c);
-				SHA1_Update(&c, read_buf, m->piece_length);
-				SHA1_Final(pos, &c);
-				pos += SHA_DIGEST_LENGTH;
-#ifndef NO_HASH_CHECK
-				counter += r;	/* r == piece_length */
-#endif
-				r = 0;
-			}
+	prefetch_init(&pf, m->readahead, m->piece_length);
+	pf.keep_going = m->keep_going;
+	if (m->tar)
+		prefetch_tar(&pf, m->tar);
+	reuse_init(&ru, m, hash_string);
+	lengths_init(m);
+	source_init(&s, m->io, &pf);
+	s.print_files = 1;
+
+	/* read and hash every piece we don't know the hash of,
+	   and skip over the ones we do */
+	for (i = 0; i < m->pieces; i++) {
+		size_t len = piece_size(m, i);
+
+		if (REUSED(&ru, i)) {
+			source_skip(&f, &off, len);
+			reused += len;
+			continue;
 		}
 
-		/* now close the file */
-		if (close(fd)) {
-			fprintf(stderr, "Error closing '%s': %s\n",
-					f->path, strerror(errno));
-			exit(EXIT_FAILURE);
-		}
+		source_read(&s, &f, &off, read_buf, len);
+		lengths_update(m, ctx, i, 0, s.iov, s.n);
+		source_digest(&s, hash_string + i * SHA_DIGEST_LENGTH);
+		source_release(&s);
 	}
+	source_done(&s);
+	prefetch_done(&pf);
 
-	/* finally append the hash of the last irregular piece to the hash string */
-	if (r) {
-		SHA1_Init(&c);
-		SHA1_Update(&c, read_buf, r);
-		SHA1_Final(pos, &c);
-	}
+	check_counter(m, s.counter + reused);
 
-#ifndef NO_HASH_CHECK
-	counter += r;
-	if (counter != m->size) {
-		fprintf(stderr, "Counted %" PRId64 " bytes, "
-				"but hashed %" PRId64 " bytes. "
-				"Something is wrong...\n", m->size, counter);
-		exit(EXIT_FAILURE);
-	}
-#endif
+	reuse_done(&ru, m, hash_string);
+
+	if (m->verbose)
+		prefetch_print_stats(&pf);
 
 	/* free the read buffer before we return */
 	free(read_buf);
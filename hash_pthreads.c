@@ -25,6 +25,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include <fcntl.h>       /* open() */
 #include <unistd.h>      /* access(), read(), close() */
 #include <inttypes.h>    /* PRId64 etc. */
+#include <sys/uio.h>     /* struct iovec */
+#include <limits.h>      /* INT_MAX */
 
 #ifdef USE_OPENSSL
 #include <openssl/sha.h> /* SHA1() */
@@ -32,8 +34,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include "sha1.h"
 #endif
 #include <pthread.h>     /* pthread functions and data structures */
+#ifdef __linux__
+#include <sys/ioctl.h>   /* ioctl() */
+#include <linux/fs.h>    /* FIBMAP, FIGETBSZ, FS_IOC_FIEMAP */
+#include <linux/fiemap.h> /* struct fiemap */
+#include <linux/perf_event.h> /* struct perf_event_attr */
+#include <sys/syscall.h> /* syscall(), SYS_perf_event_open */
+#endif
 
 #include "mktorrent.h"
+#include "prefetch.h"
+#include "reuse.h"
+#include "io.h"
 
 #define EXPORT
 #endif /* ALLINONE */
@@ -43,6 +55,14 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #define PROGRESS_PERIOD 200000
 #endif
 
+#ifndef CHUNK_SIZE
+#define CHUNK_SIZE (256 << 10)
+#endif
+
+#ifndef DEQUE_SIZE
+#define DEQUE_SIZE 4
+#endif
+
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
@@ -55,108 +75,265 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
 struct piece_s;
 typedef struct piece_s piece_t;
+struct reader_s;
+typedef struct reader_s reader_t;
+struct worker_s;
+typedef struct worker_s worker_t;
+struct queue_s;
+typedef struct queue_s queue_t;
+struct plan_s;
+typedef struct plan_s plan_t;
+
 struct piece_s {
 	piece_t *next;
+	reader_t *owner;
 	unsigned char *dest;
+	unsigned int piece;
 	unsigned long len;
 	unsigned char data[1];
 };
 
-struct queue_s;
-typedef struct queue_s queue_t;
-struct queue_s {
+/*
+ * every device holding a part of the torrent gets a reader thread of
+ * its own with a private pool of buffers, so the disks are kept busy
+ * at the same time and a slow one can't starve the others
+ */
+struct reader_s {
+	reader_t *next;
+	metafile_t *m;
+	queue_t *q;
+	dev_t dev;
+	pthread_t thread;
+	plan_t *plan;
+	unsigned int plan_len;
+	unsigned int next_plan;     /* next piece to hash with -C */
 	piece_t *free;
-	piece_t *full;
 	unsigned int buffers_max;
 	unsigned int buffers;
 	pthread_mutex_t mutex_free;
-	pthread_mutex_t mutex_full;
+	pthread_cond_t cond_free;
+	prefetch_t pf;
+	unsigned int next_worker;   /* worker to hand the next piece to */
+	unsigned long blocked;      /* times we waited for a free buffer */
+	unsigned int pieces_hashed;
+	int64_t counter;            /* bytes read */
+};
+
+/*
+ * every worker hashes the pieces in a deque of its own, oldest first,
+ * so a piece is hashed shortly after it was read while it's still in
+ * the cache. a worker with nothing to do steals the newest piece of
+ * another worker, which that worker would have gotten to last anyway
+ */
+struct worker_s {
+	queue_t *q;
+	pthread_t thread;
+	unsigned int id;
+	pthread_mutex_t mutex;
+	piece_t **slot;             /* ring of pieces to be hashed */
+	unsigned int first;         /* slot of the oldest piece */
+	unsigned int len;           /* number of pieces in the ring */
+	unsigned long stolen;       /* pieces taken from other workers */
+	uint64_t misses;            /* cache misses while hashing */
+	prefetch_t pf;              /* when reading pieces ourselves */
+	int64_t counter;            /* ..the bytes we read */
+};
+
+struct queue_s {
+	worker_t *w;
+	reader_t *readers;
+	unsigned char *hash_string;
+	reuse_t *reuse;             /* pieces we don't have to read */
+	pthread_mutex_t mutex_idle;
 	pthread_cond_t cond_empty;
-	pthread_cond_t cond_full;
+	pthread_cond_t cond_active;
 	unsigned int done;
 	unsigned int pieces;
-	unsigned int pieces_hashed;
+	unsigned int devices;       /* number of readers */
+	unsigned int workers;       /* number of workers */
+	unsigned int active;        /* workers allowed to hash */
+	unsigned int idle;          /* workers waiting for a piece */
+	unsigned int slots;         /* size of the rings of the workers */
+	unsigned long starved;      /* times a worker waited for a piece */
+	int adaptive;               /* adjust the number of active workers */
+	int count_misses;           /* count cache misses of the workers */
+	int misses_counted;         /* ..and whether we could */
+};
+
+/*
+ * a piece to be read, the file and offset it starts at and the
+ * address of its first byte on the disk
+ */
+struct plan_s {
+	unsigned int piece;
+	flist_t *f;
+	off_t off;
+	uint64_t block;
 };
 
-static piece_t *get_free(queue_t *q, size_t piece_length)
+static piece_t *get_free(reader_t *r, size_t piece_length)
 {
-	piece_t *r;
-
-	pthread_mutex_lock(&q->mutex_free);
-	if (q->free) {
-		r = q->free;
-		q->free = r->next;
-	} else if (q->buffers < q->buffers_max) {
-		r = malloc(sizeof(piece_t) - 1 + piece_length);
-		if (r == NULL) {
+	piece_t *p;
+
+	pthread_mutex_lock(&r->mutex_free);
+	if (r->free) {
+		p = r->free;
+		r->free = p->next;
+	} else if (r->buffers < r->buffers_max) {
+		p = malloc(sizeof(piece_t) - 1 + piece_length);
+		if (p == NULL) {
 			fprintf(stderr, "Out of memory.\n");
 			exit(EXIT_FAILURE);
 		}
 
-		q->buffers++;
+		p->owner = r;
+		r->buffers++;
 	} else {
-		while (q->free == NULL) {
-			pthread_cond_wait(&q->cond_full, &q->mutex_free);
+		r->blocked++;
+		while (r->free == NULL) {
+			pthread_cond_wait(&r->cond_free, &r->mutex_free);
 		}
 
-		r = q->free;
-		q->free = r->next;
+		p = r->free;
+		r->free = p->next;
 	}
-	pthread_mutex_unlock(&q->mutex_free);
+	pthread_mutex_unlock(&r->mutex_free);
 
-	return r;
+	return p;
 }
 
-static piece_t *get_full(queue_t *q)
+/*
+ * take the oldest piece from the ring of w, or the newest
+ * when stealing it from another worker
+ */
+static piece_t *take_piece(worker_t *w, int newest)
 {
-	piece_t *r;
-
-	pthread_mutex_lock(&q->mutex_full);
-again:
-	if (q->full) {
-		r = q->full;
-		q->full = r->next;
-	} else if (q->done) {
-		r = NULL;
-	} else {
-		pthread_cond_wait(&q->cond_empty, &q->mutex_full);
-		goto again;
+	piece_t *p = NULL;
+
+	pthread_mutex_lock(&w->mutex);
+	if (w->len) {
+		w->len--;
+		if (newest)
+			p = w->slot[(w->first + w->len) % w->q->slots];
+		else {
+			p = w->slot[w->first];
+			w->first = (w->first + 1) % w->q->slots;
+		}
+	}
+	pthread_mutex_unlock(&w->mutex);
+
+	return p;
+}
+
+static piece_t *steal_piece(worker_t *w)
+{
+	queue_t *q = w->q;
+	unsigned int i;
+	piece_t *p;
+
+	for (i = 1; i < q->workers; i++) {
+		p = take_piece(&q->w[(w->id + i) % q->workers], 1);
+		if (p) {
+			w->stolen++;
+			return p;
+		}
+	}
+
+	return NULL;
+}
+
+static piece_t *get_full(worker_t *w)
+{
+	queue_t *q = w->q;
+	piece_t *p;
+
+	/* the fast path only touches our own ring */
+	if ((p = take_piece(w, 0)))
+		return p;
+
+	pthread_mutex_lock(&q->mutex_idle);
+	while (1) {
+		if (w->id >= q->active && !q->done) {
+			/* we've been told to rest */
+			pthread_cond_wait(&q->cond_active, &q->mutex_idle);
+			continue;
+		}
+
+		/* pieces are only added while holding mutex_idle,
+		   so none can slip by between looking and waiting */
+		if ((p = take_piece(w, 0)) || (p = steal_piece(w)))
+			break;
+		if (q->done)
+			break;
+
+		q->starved++;
+		q->idle++;
+		pthread_cond_wait(&q->cond_empty, &q->mutex_idle);
+		q->idle--;
 	}
-	pthread_mutex_unlock(&q->mutex_full);
+	pthread_mutex_unlock(&q->mutex_idle);
 
-	return r;
+	return p;
 }
 
-static void put_free(queue_t *q, piece_t *p, unsigned int hashed)
+static void put_free(piece_t *p, unsigned int hashed)
 {
-	pthread_mutex_lock(&q->mutex_free);
-	p->next = q->free;
-	q->free = p;
-	q->pieces_hashed += hashed;
-	pthread_mutex_unlock(&q->mutex_free);
-	pthread_cond_signal(&q->cond_full);
+	reader_t *r = p->owner;
+
+	pthread_mutex_lock(&r->mutex_free);
+	p->next = r->free;
+	r->free = p;
+	r->pieces_hashed += hashed;
+	pthread_mutex_unlock(&r->mutex_free);
+	pthread_cond_signal(&r->cond_free);
 }
 
-static void put_full(queue_t *q, piece_t *p)
+/*
+ * hand the piece to the next worker allowed to hash with room for it
+ * in its ring. the rings have room for all the buffers, so when every
+ * worker has DEQUE_SIZE pieces waiting we just pile on the next one
+ */
+static void put_full(reader_t *r, piece_t *p)
 {
-	pthread_mutex_lock(&q->mutex_full);
-	p->next = q->full;
-	q->full = p;
-	pthread_mutex_unlock(&q->mutex_full);
-	pthread_cond_signal(&q->cond_empty);
+	queue_t *q = r->q;
+	worker_t *w = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&q->mutex_idle);
+	for (i = 0; i < q->active; i++) {
+		w = &q->w[(r->next_worker + i) % q->active];
+		pthread_mutex_lock(&w->mutex);
+		if (w->len < DEQUE_SIZE)
+			break;
+		pthread_mutex_unlock(&w->mutex);
+	}
+	if (i == q->active) {
+		i = 0;
+		w = &q->w[r->next_worker % q->active];
+		pthread_mutex_lock(&w->mutex);
+	}
+	w->slot[(w->first + w->len) % q->slots] = p;
+	w->len++;
+	pthread_mutex_unlock(&w->mutex);
+	r->next_worker = (r->next_worker + i + 1) % q->active;
+
+	if (q->idle)
+		pthread_cond_signal(&q->cond_empty);
+	pthread_mutex_unlock(&q->mutex_idle);
 }
 
 static void set_done(queue_t *q)
 {
-	pthread_mutex_lock(&q->mutex_full);
+	pthread_mutex_lock(&q->mutex_idle);
 	q->done = 1;
-	pthread_mutex_unlock(&q->mutex_full);
+	pthread_mutex_unlock(&q->mutex_idle);
 	pthread_cond_broadcast(&q->cond_empty);
+	pthread_cond_broadcast(&q->cond_active);
 }
 
-static void free_buffers(queue_t *q)
+static void free_buffers(reader_t *r)
 {
-	piece_t *first = q->free;
+	piece_t *first = r->free;
 
 	while (first) {
 		piece_t *p = first;
@@ -164,156 +341,567 @@ static void free_buffers(queue_t *q)
 		free(p);
 	}
 
-	q->free = NULL;
+	r->free = NULL;
+}
+
+static unsigned int pieces_hashed(queue_t *q)
+{
+	reader_t *r;
+	unsigned int n = 0;
+
+	for (r = q->readers; r; r = r->next)
+		n += r->pieces_hashed;
+
+	return n;
+}
+
+/*
+ * let one more worker hash when the readers had to wait for free
+ * buffers while the workers never waited for pieces, and one less
+ * in the opposite case, when reading can't keep up with hashing
+ */
+static void adapt(queue_t *q, unsigned long *blocked, unsigned long *starved)
+{
+	reader_t *r;
+	unsigned long b = 0;
+
+	for (r = q->readers; r; r = r->next)
+		b += r->blocked;
+
+	pthread_mutex_lock(&q->mutex_idle);
+	if (b > *blocked && q->starved == *starved
+			&& q->active < q->workers) {
+		q->active++;
+		pthread_cond_broadcast(&q->cond_active);
+	} else if (q->starved > *starved && b == *blocked && q->active > 1)
+		q->active--;
+	*starved = q->starved;
+	pthread_mutex_unlock(&q->mutex_idle);
+
+	*blocked = b;
 }
 
 /*
  * print the progress in a thread of its own
+ * and adjust the number of active workers if we should
  */
 static void *print_progress(void *data)
 {
 	queue_t *q = data;
-	int err;
-
-	err = pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-	if (err) {
-		fprintf(stderr, "Error setting thread cancel type: %s\n",
-				strerror(err));
-		exit(EXIT_FAILURE);
-	}
+	unsigned long blocked = 0;
+	unsigned long starved = 0;
 
 	while (1) {
 		/* print progress and flush the buffer immediately */
-		printf("\rHashed %u of %u pieces.", q->pieces_hashed, q->pieces);
+		printf("\rHashed %u of %u pieces.", pieces_hashed(q), q->pieces);
 		fflush(stdout);
 		/* now sleep for PROGRESS_PERIOD microseconds */
 		usleep(PROGRESS_PERIOD);
+		pthread_testcancel();
+
+		if (q->adaptive)
+			adapt(q, &blocked, &starved);
 	}
 
 	return NULL;
 }
 
+/*
+ * start counting the cache misses of the calling thread.
+ * returns -1 when we aren't allowed to or there is no such counter
+ */
+static int open_miss_counter(void)
+{
+#if defined __linux__ && defined SYS_perf_event_open
+	struct perf_event_attr a;
+
+	memset(&a, 0, sizeof(a));
+	a.type = PERF_TYPE_HARDWARE;
+	a.size = sizeof(a);
+	a.config = PERF_COUNT_HW_CACHE_MISSES;
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &a, 0, -1, -1, 0);
+#else
+	return -1;
+#endif
+}
+
+static void stop_miss_counter(queue_t *q, worker_t *w, int fd)
+{
+	if (fd < 0)
+		return;
+
+	if (read(fd, &w->misses, sizeof(w->misses)) == sizeof(w->misses)) {
+		pthread_mutex_lock(&q->mutex_idle);
+		q->misses_counted = 1;
+		pthread_mutex_unlock(&q->mutex_idle);
+	}
+	close(fd);
+}
+
 static void *worker(void *data)
 {
-	queue_t *q = data;
+	worker_t *w = data;
+	queue_t *q = w->q;
 	piece_t *p;
-	SHA_CTX c;
+	SHA_CTX ctx[MAX_LENGTHS];
+	struct iovec iov;
+	int fd = -1;
 
-	while ((p = get_full(q))) {
-		SHA1_Init(&c);
-		SHA1_Update(&c, p->data, p->len);
-		SHA1_Final(p->dest, &c);
-		put_free(q, p, 1);
+	if (q->count_misses)
+		fd = open_miss_counter();
+
+	while ((p = get_full(w))) {
+		iov.iov_base = p->data;
+		iov.iov_len = p->len;
+		lengths_update(p->owner->m, ctx, p->piece, 0, &iov, 1);
+		SHA1(p->data, p->len, p->dest);
+		put_free(p, 1);
 	}
 
+	stop_miss_counter(q, w, fd);
+
 	return NULL;
 }
 
-static void read_files(metafile_t *m, queue_t *q, unsigned char *pos)
+/*
+ * read the pieces planned for the reader's device one by one and
+ * hand them to the workers. pieces on other devices are left to
+ * their own readers, so the hash string is filled out of order
+ */
+static void *read_device(void *data)
 {
-	int fd;              /* file descriptor */
-	flist_t *f;          /* pointer to a place in the file list */
-	size_t r = 0;        /* number of bytes read from file(s)
-	                        into the read buffer */
-#ifndef NO_HASH_CHECK
-	int64_t counter = 0;	/* number of bytes hashed
-				   should match size when done */
-#endif
-	piece_t *p = get_free(q, m->piece_length);
+	reader_t *r = data;
+	metafile_t *m = r->m;
+	source_t s;
+	plan_t *pl;
 
-	/* go through all the files in the file list */
-	for (f = m->file_list; f; f = f->next) {
+	prefetch_init(&r->pf, m->readahead, m->piece_length);
+	r->pf.keep_going = m->keep_going;
+	if (m->tar)
+		prefetch_tar(&r->pf, m->tar);
+	source_init(&s, m->io, &r->pf);
 
-		/* open the current file for reading */
-		if ((fd = open(f->path, OPENFLAGS)) == -1) {
-			fprintf(stderr, "Error opening '%s' for reading: %s\n",
-					f->path, strerror(errno));
-			exit(EXIT_FAILURE);
+	for (pl = r->plan; pl < r->plan + r->plan_len; pl++) {
+		size_t len = piece_size(m, pl->piece);
+		flist_t *f = pl->f;
+		off_t off = pl->off;
+		piece_t *p;
+
+		p = get_free(r, m->piece_length);
+		p->dest = r->q->hash_string + pl->piece * SHA_DIGEST_LENGTH;
+		p->piece = pl->piece;
+		p->len = source_read(&s, &f, &off, p->data, len);
+		if (p->len)
+			put_full(r, p);
+		else
+			put_free(p, 0);
+	}
+
+	source_done(&s);
+	r->counter = s.counter;
+	prefetch_done(&r->pf);
+
+	return NULL;
+}
+
+/*
+ * take the next piece planned for a device, starting with the
+ * device of the worker so the workers are spread over them
+ */
+static reader_t *next_plan(queue_t *q, unsigned int id, plan_t **pl)
+{
+	reader_t *r;
+	unsigned int i;
+
+	for (r = q->readers; id && r->next; id--)
+		r = r->next;
+
+	for (i = 0; i < q->devices; i++) {
+		pthread_mutex_lock(&r->mutex_free);
+		if (r->next_plan < r->plan_len) {
+			*pl = r->plan + r->next_plan++;
+			pthread_mutex_unlock(&r->mutex_free);
+			return r;
 		}
+		pthread_mutex_unlock(&r->mutex_free);
 
-		while (1) {
-			ssize_t d = read(fd, p->data + r, m->piece_length - r);
+		r = r->next ? r->next : q->readers;
+	}
 
-			if (d < 0) {
-				fprintf(stderr, "Error reading from '%s': %s\n",
-						f->path, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
+	return NULL;
+}
 
-			if (d == 0) /* end of file */
-				break;
+/*
+ * read and hash whole pieces a CHUNK_SIZE at a time in the same
+ * thread, so every chunk is hashed while it is still in the cache
+ * instead of being read into a piece buffer, handed over and read
+ * back from memory by a worker on another core. with -I mmap whole
+ * pieces are mapped and hashed where they are instead
+ */
+static void *hash_pieces(void *data)
+{
+	worker_t *w = data;
+	queue_t *q = w->q;
+	metafile_t *m;
+	size_t chunk_size;
+	unsigned char *chunk;
+	source_t s;
+	reader_t *r;
+	plan_t *pl;
+	SHA_CTX ctx;
+	SHA_CTX lengths[MAX_LENGTHS];
+	int fd = -1;
 
-			r += d;
+	/* nothing to read */
+	if (q->readers == NULL)
+		return NULL;
 
-			if (r == m->piece_length) {
-				p->dest = pos;
-				p->len = m->piece_length;
-				put_full(q, p);
-				pos += SHA_DIGEST_LENGTH;
-#ifndef NO_HASH_CHECK
-				counter += r;
-#endif
-				r = 0;
-				p = get_free(q, m->piece_length);
+	m = q->readers->m;
+	chunk_size = CHUNK_SIZE < m->piece_length ?
+		CHUNK_SIZE : m->piece_length;
+	chunk = malloc(chunk_size);
+	if (chunk == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (q->count_misses)
+		fd = open_miss_counter();
+
+	/* the pieces of a worker aren't next to each other,
+	   so opening files ahead would only cost descriptors */
+	prefetch_init(&w->pf, 0, chunk_size);
+	w->pf.keep_going = m->keep_going;
+	if (m->tar)
+		prefetch_tar(&w->pf, m->tar);
+	source_init(&s, m->io, &w->pf);
+
+	while ((r = next_plan(q, w->id, &pl))) {
+		size_t left = piece_size(m, pl->piece);
+		flist_t *f = pl->f;
+		off_t off = pl->off;
+		size_t pos = 0;
+		unsigned char *dest = q->hash_string
+			+ pl->piece * SHA_DIGEST_LENGTH;
+
+		if (m->io == IO_MMAP || left <= chunk_size) {
+			/* a piece that is mapped or fits in a
+			   chunk is hashed in one go */
+			source_read(&s, &f, &off, chunk, left);
+			lengths_update(m, lengths, pl->piece, 0, s.iov, s.n);
+			source_digest(&s, dest);
+			source_release(&s);
+		} else {
+			SHA1_Init(&ctx);
+			while (left) {
+				size_t n = source_read(&s, &f, &off, chunk,
+						left < chunk_size ?
+						left : chunk_size);
+
+				if (n == 0)
+					break;
+				lengths_update(m, lengths, pl->piece, pos,
+						s.iov, s.n);
+				source_update(&ctx, &s);
+				pos += n;
+				left -= n;
 			}
+			SHA1_Final(dest, &ctx);
 		}
 
-		/* now close the file */
-		if (close(fd)) {
-			fprintf(stderr, "Error closing '%s': %s\n",
-					f->path, strerror(errno));
+		pthread_mutex_lock(&r->mutex_free);
+		r->pieces_hashed++;
+		pthread_mutex_unlock(&r->mutex_free);
+	}
+
+	source_done(&s);
+	w->counter = s.counter;
+	prefetch_done(&w->pf);
+	free(chunk);
+	stop_miss_counter(q, w, fd);
+
+	return NULL;
+}
+
+/*
+ * create a reader for every device holding a part of the torrent
+ */
+static unsigned int add_readers(metafile_t *m, queue_t *q)
+{
+	flist_t *f;
+	reader_t *r;
+	unsigned int n = 0;
+
+	for (f = m->file_list; f; f = f->next) {
+		if (f->size == 0)
+			continue;
+
+		for (r = q->readers; r; r = r->next)
+			if (r->dev == f->dev)
+				break;
+		if (r)
+			continue;
+
+		r = calloc(1, sizeof(reader_t));
+		if (r == NULL) {
+			fprintf(stderr, "Out of memory.\n");
 			exit(EXIT_FAILURE);
 		}
+
+		r->m = m;
+		r->q = q;
+		r->dev = f->dev;
+		pthread_mutex_init(&r->mutex_free, NULL);
+		pthread_cond_init(&r->cond_free, NULL);
+		r->next = q->readers;
+		q->readers = r;
+		n++;
 	}
 
-	/* finally append the hash of the last irregular piece to the hash string */
-	if (r) {
-		p->dest = pos;
-		p->len = r;
-		put_full(q, p);
-	} else
-		put_free(q, p, 0);
-
-#ifndef NO_HASH_CHECK
-	counter += r;
-	if (counter != m->size) {
-		fprintf(stderr, "Counted %" PRId64 " bytes, "
-				"but hashed %" PRId64 " bytes. "
-				"Something is wrong...\n", m->size, counter);
-		exit(EXIT_FAILURE);
+	if (n == 0)
+		return 0;
+
+	/* split the buffers we would have used for a single device
+	   between them, but let each device have at least two
+	   so it can read one piece while another is being hashed */
+	for (r = q->readers; r; r = r->next) {
+		r->buffers_max = 3*m->threads / n;
+		if (r->buffers_max < 2)
+			r->buffers_max = 2;
+	}
+
+	return n;
+}
+
+/*
+ * call fn for every piece we have to read with the file and offset
+ * the piece starts at
+ */
+static void for_each_piece(metafile_t *m, queue_t *q,
+		void (*fn)(reader_t *r, unsigned int piece, flist_t *f, off_t off))
+{
+	flist_t *f = m->file_list;  /* file holding the start of the piece */
+	off_t off = 0;              /* offset of the piece in f */
+	unsigned int i;
+
+	/* step over empty files at the start, skipping a piece
+	   steps over those after it */
+	source_skip(&f, &off, 0);
+
+	for (i = 0; i < m->pieces; i++) {
+		reader_t *r;
+
+		if (!REUSED(q->reuse, i)) {
+			for (r = q->readers; r->dev != f->dev; r = r->next);
+			fn(r, i, f, off);
+		}
+
+		source_skip(&f, &off, piece_size(m, i));
+	}
+}
+
+static void count_piece(reader_t *r, unsigned int piece, flist_t *f, off_t off)
+{
+	(void) piece;
+	(void) f;
+	(void) off;
+
+	r->plan_len++;
+}
+
+static void plan_piece(reader_t *r, unsigned int piece, flist_t *f, off_t off)
+{
+	plan_t *pl = r->plan + r->plan_len++;
+
+	pl->piece = piece;
+	pl->f = f;
+	pl->off = off;
+	pl->block = 0;
+}
+
+/*
+ * look up where on the disk the byte at offset off of the open file
+ * fd is stored. returns 0 when the file system won't tell us, or the
+ * byte isn't stored anywhere yet (holes, delayed allocation)
+ */
+static uint64_t block_address(int fd, off_t off)
+{
+#ifdef FS_IOC_FIEMAP
+	struct {
+		struct fiemap fm;
+		struct fiemap_extent fe;
+	} x;
+
+	memset(&x, 0, sizeof(x));
+	x.fm.fm_start = off;
+	x.fm.fm_length = 1;
+	x.fm.fm_flags = 0;
+	x.fm.fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, &x.fm) == 0) {
+		if (x.fm.fm_mapped_extents == 0 ||
+				(x.fe.fe_flags & FIEMAP_EXTENT_UNKNOWN))
+			return 0;
+		return x.fe.fe_physical + (off - x.fe.fe_logical);
+	}
+#endif
+#ifdef FIBMAP
+	{
+		/* older file systems only answer FIBMAP,
+		   which needs CAP_SYS_RAWIO */
+		int bsz;
+		int block;
+		off_t index;
+
+		/* it takes the block index in an int, so it can't
+		   tell us about blocks past INT_MAX */
+		if (ioctl(fd, FIGETBSZ, &bsz) == 0 && bsz > 0
+				&& (index = off / bsz) <= INT_MAX) {
+			block = (int) index;
+			if (ioctl(fd, FIBMAP, &block) == 0 && block > 0)
+				return (uint64_t) block * bsz + off % bsz;
+		}
 	}
 #endif
+	return 0;
+}
+
+static int compare_blocks(const void *a, const void *b)
+{
+	const plan_t *x = a;
+	const plan_t *y = b;
+
+	if (x->block != y->block)
+		return x->block < y->block ? -1 : 1;
+
+	return x->piece < y->piece ? -1 : x->piece > y->piece;
+}
+
+/*
+ * sort the pieces of a reader by where they start on the disk,
+ * so spinning disks don't have to seek back and forth when the
+ * files are laid out in another order than we hash them in.
+ * a piece spanning several files is still read in one go, so
+ * we never have to hold on to more than one partial piece
+ */
+static void order_by_block(metafile_t *m, reader_t *r)
+{
+	plan_t *pl;
+	flist_t *f = NULL;
+	int fd = -1;
+	uint64_t last = 0;
+
+	for (pl = r->plan; pl < r->plan + r->plan_len; pl++) {
+		if (pl->f != f) {
+			if (fd >= 0)
+				close(fd);
+			f = pl->f;
+			fd = open(m->tar ? m->tar : f->path, OPENFLAGS);
+		}
+
+		/* keep pieces we can't place next to their predecessor */
+		if (fd >= 0)
+			pl->block = block_address(fd, f->offset + pl->off);
+		if (pl->block == 0)
+			pl->block = last;
+		last = pl->block;
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	qsort(r->plan, r->plan_len, sizeof(plan_t), compare_blocks);
+}
+
+/*
+ * make a plan of which pieces every reader should read in what order
+ */
+static void plan_reads(metafile_t *m, queue_t *q)
+{
+	reader_t *r;
+
+	for_each_piece(m, q, count_piece);
+
+	for (r = q->readers; r; r = r->next) {
+		r->plan = malloc(r->plan_len * sizeof(plan_t));
+		if (r->plan == NULL && r->plan_len) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		r->plan_len = 0;
+	}
+
+	for_each_piece(m, q, plan_piece);
+
+	if (m->block_order)
+		for (r = q->readers; r; r = r->next)
+			order_by_block(m, r);
 }
 
 EXPORT unsigned char *make_hash(metafile_t *m)
 {
 	queue_t q = {
-		NULL, NULL, 0, 0,
-		PTHREAD_MUTEX_INITIALIZER,
+		NULL, NULL, NULL, NULL,
 		PTHREAD_MUTEX_INITIALIZER,
 		PTHREAD_COND_INITIALIZER,
 		PTHREAD_COND_INITIALIZER,
-		0, 0, 0
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 	};
 	pthread_t print_progress_thread;	/* progress printer thread */
-	pthread_t *workers;
-	unsigned char *hash_string;		/* the hash string */
+	worker_t *w;
+	reader_t *r;
+	unsigned int devices;
 	int i;
 	int err;
+	prefetch_t stats;	/* read statistics of all readers */
+	reuse_t ru;		/* pieces we know the hashes of */
+	unsigned long stolen = 0;	/* pieces stolen by the workers */
+	uint64_t misses = 0;	/* cache misses of the workers */
+	int64_t counter = 0;	/* number of bytes hashed
+				   should match size when done */
 
-	workers = malloc(m->threads * sizeof(pthread_t));
-	hash_string = malloc(m->pieces * SHA_DIGEST_LENGTH);
-	if (workers == NULL || hash_string == NULL) {
+	q.w = w = calloc(m->threads, sizeof(worker_t));
+	q.hash_string = malloc(m->pieces * SHA_DIGEST_LENGTH);
+	if (w == NULL || q.hash_string == NULL) {
 		fprintf(stderr, "Out of memory.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	q.pieces = m->pieces;
-	q.buffers_max = 3*m->threads;
+	memset(&stats, 0, sizeof(stats));
+	reuse_init(&ru, m, q.hash_string);
+	lengths_init(m);
+	q.reuse = &ru;
+	q.pieces = m->pieces - ru.reused;
+	q.workers = m->threads;
+	q.count_misses = m->verbose;
+	q.adaptive = m->adaptive_threads;
+	/* when adapting, start out with half the workers hashing */
+	q.active = q.adaptive ? (m->threads + 1) / 2 : m->threads;
+	q.devices = devices = add_readers(m, &q);
+	if (m->verbose && devices > 1)
+		printf("Reading from %u devices in parallel.\n", devices);
+	plan_reads(m, &q);
+
+	/* make the rings big enough to hold every buffer there is */
+	for (r = q.readers; r; r = r->next)
+		q.slots += r->buffers_max;
 
 	/* create worker threads */
 	for (i = 0; i < m->threads; i++) {
-		err = pthread_create(&workers[i], NULL, worker, &q);
+		w[i].q = &q;
+		w[i].id = i;
+		pthread_mutex_init(&w[i].mutex, NULL);
+		w[i].slot = malloc((q.slots ? q.slots : 1) * sizeof(piece_t *));
+		if (w[i].slot == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		err = pthread_create(&w[i].thread, NULL,
+				m->cache_resident ? hash_pieces : worker,
+				&w[i]);
 		if (err) {
 			fprintf(stderr, "Error creating thread: %s\n",
 					strerror(err));
@@ -329,15 +917,25 @@ EXPORT unsigned char *make_hash(metafile_t *m)
 		exit(EXIT_FAILURE);
 	}
 
-	/* read files and feed pieces to the workers */
-	read_files(m, &q, hash_string);
+	/* read files and feed pieces to the workers
+	   unless they read the pieces themselves */
+	for (r = q.readers; r && !m->cache_resident; r = r->next) {
+		err = pthread_create(&r->thread, NULL, read_device, r);
+		if (err) {
+			fprintf(stderr, "Error creating thread: %s\n",
+					strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	/* we're done so stop printing our progress. */
-	err = pthread_cancel(print_progress_thread);
-	if (err) {
-		fprintf(stderr, "Error cancelling thread: %s\n",
-				strerror(err));
-		exit(EXIT_FAILURE);
+	/* wait for the readers to finish */
+	for (r = q.readers; r && !m->cache_resident; r = r->next) {
+		err = pthread_join(r->thread, NULL);
+		if (err) {
+			fprintf(stderr, "Error joining thread: %s\n",
+					strerror(err));
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	/* inform workers we're done */
@@ -345,15 +943,46 @@ EXPORT unsigned char *make_hash(metafile_t *m)
 
 	/* wait for workers to finish */
 	for (i = 0; i < m->threads; i++) {
-		err = pthread_join(workers[i], NULL);
+		err = pthread_join(w[i].thread, NULL);
 		if (err) {
 			fprintf(stderr, "Error joining thread: %s\n",
 					strerror(err));
 			exit(EXIT_FAILURE);
 		}
+		stolen += w[i].stolen;
+		misses += w[i].misses;
+		stats.reads += w[i].pf.reads;
+		stats.stalls += w[i].pf.stalls;
+		stats.stall_usec += w[i].pf.stall_usec;
+		stats.retries += w[i].pf.retries;
+		counter += w[i].counter;
+		pthread_mutex_destroy(&w[i].mutex);
+		free(w[i].slot);
+	}
+
+	free(w);
+
+	for (r = q.readers; r; r = r->next) {
+		stats.reads += r->pf.reads;
+		stats.stalls += r->pf.stalls;
+		stats.stall_usec += r->pf.stall_usec;
+		stats.retries += r->pf.retries;
+		counter += r->counter;
 	}
 
-	free(workers);
+	/* the last piece we didn't read may be a short one */
+	for (i = 0; i < (int) m->pieces; i++)
+		if (REUSED(&ru, i))
+			counter += piece_size(m, i);
+	check_counter(m, counter);
+
+	/* we're done so stop printing our progress. */
+	err = pthread_cancel(print_progress_thread);
+	if (err) {
+		fprintf(stderr, "Error cancelling thread: %s\n",
+				strerror(err));
+		exit(EXIT_FAILURE);
+	}
 
 	/* the progress printer should be done by now too */
 	err = pthread_join(print_progress_thread, NULL);
@@ -363,17 +992,34 @@ EXPORT unsigned char *make_hash(metafile_t *m)
 		exit(EXIT_FAILURE);
 	}
 
-	/* destroy mutexes and condition variables */
-	pthread_mutex_destroy(&q.mutex_full);
-	pthread_mutex_destroy(&q.mutex_free);
-	pthread_cond_destroy(&q.cond_empty);
-	pthread_cond_destroy(&q.cond_full);
-
-	/* free buffers */
-	free_buffers(&q);
-
 	/* ok, let the user know we're done too */
-	printf("\rHashed %u of %u pieces.\n", q.pieces_hashed, q.pieces);
+	printf("\rHashed %u of %u pieces.\n", pieces_hashed(&q), q.pieces);
+	reuse_done(&ru, m, q.hash_string);
+	if (m->verbose) {
+		prefetch_print_stats(&stats);
+		if (!m->cache_resident)
+			printf("Stole %lu of %u pieces from other workers.\n",
+					stolen, q.pieces);
+		if (q.misses_counted && q.pieces)
+			printf("Had %" PRIu64 " cache misses per piece hashed.\n",
+					misses / q.pieces);
+		if (q.adaptive)
+			printf("Ended up with %u of %ld threads hashing.\n",
+					q.active, m->threads);
+	}
+
+	/* destroy mutexes and condition variables and free buffers */
+	pthread_mutex_destroy(&q.mutex_idle);
+	pthread_cond_destroy(&q.cond_empty);
+	pthread_cond_destroy(&q.cond_active);
+	while ((r = q.readers)) {
+		q.readers = r->next;
+		pthread_mutex_destroy(&r->mutex_free);
+		pthread_cond_destroy(&r->cond_free);
+		free_buffers(r);
+		free(r->plan);
+		free(r);
+	}
 
-	return hash_string;
+	return q.hash_string;
 }
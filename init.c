@@ -30,14 +30,21 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #ifdef USE_LONG_OPTIONS
 #include <getopt.h>       /* getopt_long() */
 #endif
+#ifdef __linux__
+#include <sys/syscall.h>  /* SYS_sched_getaffinity */
+#endif
 
 #include "mktorrent.h"
 #include "ftw.h"
+#include "tar.h"
+#include "filter.h"
 
 #define EXPORT
 
 /* output.c */
 extern int is_bencode_int(char *s);
+/* edit.c */
+extern void read_metainfo(metafile_t *m, const char *path);
 #else  /* ALLINONE */
 /* output.c is included after init.c */
 int is_bencode_int(char *s);
@@ -48,6 +55,16 @@ int is_bencode_int(char *s);
 			   file_tree_walk() will open */
 #endif
 
+/* names of the IO_* methods, io_uring only when we can use it */
+static const char *io_names[] = {
+	"read", "mmap", "pread", "direct", "io_uring"
+};
+#ifdef USE_IO_URING
+#define IO_METHODS 5
+#else
+#define IO_METHODS 4
+#endif
+
 static void strip_ending_dirseps(char *s)
 {
 	char *end = s;
@@ -73,6 +90,31 @@ static const char *basename(const char *s)
 	return r;
 }
 
+/*
+ * the basename of a tar file without the .tar, which is what it
+ * would be called when extracted
+ */
+static const char *tar_basename(const char *s)
+{
+	char *r;
+	size_t len;
+
+	s = basename(s);
+	len = strlen(s);
+	if (len <= 4 || strcmp(s + len - 4, ".tar"))
+		return s;
+
+	r = malloc(len - 3);
+	if (r == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(r, s, len - 4);
+	r[len - 4] = '\0';
+
+	return r;
+}
+
 static char *realloc_str(char *s, size_t l)
 {
 #ifdef DEBUG
@@ -86,6 +128,33 @@ static char *realloc_str(char *s, size_t l)
 	return s;
 }
 
+/*
+ * return path with the working directory prepended if it is relative,
+ * so it still points to the same file after we change directory
+ */
+static char *absolute_path(char *path)
+{
+	char *string;
+	size_t length = strlen(path) + 128;
+
+	if (*path == DIRSEP[0])
+		return path;
+
+	string = realloc_str(NULL, length);
+	while (getcwd(string, length - strlen(path) - 1) == NULL) {
+		if (errno != ERANGE) {
+			perror(PROGRAM ": Error getting working directory");
+			exit(EXIT_FAILURE);
+		}
+		length *= 2;
+		string = realloc_str(string, length);
+	}
+	strcat(string, DIRSEP);
+	strcat(string, path);
+
+	return string;
+}
+
 static void set_absolute_file_path(metafile_t *m)
 {
 	int is_dir;		/* is metainfo_file_path a dir */
@@ -197,6 +266,82 @@ static void set_absolute_file_path(metafile_t *m)
 	m->metainfo_file_path = string;
 }
 
+/*
+ * the path of the metainfo file made with a piece length of 2^n bytes
+ * when there are several, which is path with .<n> before .torrent
+ */
+static char *length_path(const char *path, unsigned int n)
+{
+	size_t len = strlen(path);
+	char *s = malloc(len + 4);
+
+	if (s == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (len >= 8 && strcmp(path + len - 8, ".torrent") == 0)
+		sprintf(s, "%.*s.%u.torrent", (int) (len - 8), path, n);
+	else
+		sprintf(s, "%s.%u", path, n);
+
+	return s;
+}
+
+/*
+ * read the piece lengths of -l, a comma separated list of powers of 2.
+ * the longest is the one we hash with, the others go in m->lengths,
+ * longest first, to be hashed along with it
+ */
+static void read_piece_lengths(metafile_t *m, const char *arg)
+{
+	const char *s = arg;
+	plist_t *list = NULL;
+	plist_t **p;
+	plist_t *l;
+	char *end;
+	long n;
+
+	do {
+		n = strtol(s, &end, 10);
+
+		if (end == s || (*end != ',' && *end != '\0')
+				|| n < 15 || n > 28) {
+			fprintf(stderr, PROGRAM ": Invalid piece length %s\n",
+					arg);
+			fprintf(stderr, "The piece length must be"
+				" a number between 15 and 28.\n");
+			exit(EXIT_FAILURE);
+		}
+		s = end + 1;
+
+		for (p = &list; *p && (long) (*p)->piece_length > n;
+				p = &(*p)->next);
+		if (*p && (long) (*p)->piece_length == n)
+			continue;
+
+		l = calloc(1, sizeof(plist_t));
+		if (l == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		l->piece_length = n;
+		l->fd = -1;
+		l->next = *p;
+		*p = l;
+	} while (*end == ',');
+
+	/* the last -l given wins */
+	while ((l = m->lengths)) {
+		m->lengths = l->next;
+		free(l);
+	}
+
+	m->piece_length = list->piece_length;
+	m->lengths = list->next;
+	free(list);
+}
+
 /*
  * add an extra info dictionary field node from a colon separated string
  */
@@ -251,6 +396,7 @@ static void add_extra(metafile_t *m, char *s)
 		exit(EXIT_FAILURE);
 	}
 	/* initialize new node's next ptr */
+	extra_new->raw_len = 0;
 	extra_new->next = NULL;
 
 	/* test against canonical fields */
@@ -372,6 +518,17 @@ static int is_dir(metafile_t *m, char *target)
 	}
 	m->file_list->path = target;
 	m->file_list->size = s.st_size;
+	m->file_list->pad = 0;
+	m->file_list->dev = s.st_dev;
+	m->file_list->ino = s.st_ino;
+	m->file_list->mtime = s.st_mtime;
+	m->file_list->ctime = s.st_ctime;
+	m->file_list->mtime_nsec = ST_MTIME_NSEC(&s);
+	m->file_list->ctime_nsec = ST_CTIME_NSEC(&s);
+	m->file_list->sparse = (off_t) s.st_blocks * 512 < s.st_size;
+	m->file_list->offset = 0;
+	m->file_list->error = 0;
+	m->file_list->changed = 0;
 	m->file_list->next = NULL;
 	/* ..and size variable */
 	m->size = s.st_size;
@@ -380,6 +537,172 @@ static int is_dir(metafile_t *m, char *target)
 	return 0;
 }
 
+/*
+ * compare paths byte by byte, except that a directory separator sorts
+ * before anything else so the contents of a directory are kept together
+ * the way they would be if we compared one path component at a time.
+ * unlike strcasecmp() this doesn't depend on the locale and never
+ * considers two different paths equal
+ */
+static int path_cmp(const char *a, const char *b)
+{
+	const unsigned char *p = (const unsigned char *) a;
+	const unsigned char *q = (const unsigned char *) b;
+
+	while (*p && *p == *q) {
+		p++;
+		q++;
+	}
+
+	if (*p == *q)
+		return 0;
+	if (*p == DIRSEP[0])
+		return *q ? -1 : 1;
+	if (*q == DIRSEP[0])
+		return *p ? 1 : -1;
+	return *p - *q;
+}
+
+/*
+ * make sure a name is valid UTF-8, and warn if it has combining accents.
+ * those are usually left over from a file system that decomposes names,
+ * and the same contents with composed names would give another torrent.
+ * we don't normalise the names ourselves, as that takes the tables of
+ * a Unicode library
+ */
+static void check_utf8(const char *name)
+{
+	const unsigned char *p = (const unsigned char *) name;
+	int warned = 0;
+
+	while (*p) {
+		unsigned long c;
+		int n, i;
+
+		if (*p < 0x80) {
+			p++;
+			continue;
+		} else if (*p >= 0xC2 && *p <= 0xDF) {
+			c = *p & 0x1F;
+			n = 1;
+		} else if (*p >= 0xE0 && *p <= 0xEF) {
+			c = *p & 0x0F;
+			n = 2;
+		} else if (*p >= 0xF0 && *p <= 0xF4) {
+			c = *p & 0x07;
+			n = 3;
+		} else
+			break;
+
+		for (i = 1; i <= n && (p[i] & 0xC0) == 0x80; i++)
+			c = c << 6 | (p[i] & 0x3F);
+		/* no truncated, overlong or surrogate sequences
+		   and nothing beyond U+10FFFF */
+		if (i <= n || (n == 2 && c < 0x800)
+				|| (n == 3 && (c < 0x10000 || c > 0x10FFFF))
+				|| (c >= 0xD800 && c <= 0xDFFF))
+			break;
+
+		if (!warned && c >= 0x0300 && c <= 0x036F) {
+			fprintf(stderr, "Warning: '%s' has combining accents, "
+				"so the torrent won't match one made from "
+				"composed names.\n", name);
+			warned = 1;
+		}
+		p += n + 1;
+	}
+
+	if (*p) {
+		fprintf(stderr, "Error: '%s' is not valid UTF-8.\n", name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * add the file at path, of the size and times in sb, to the front of
+ * the file list and its size to the total. sort_files() puts the list
+ * in order once we have them all. returns the new node, or NULL if we
+ * run out of memory
+ */
+static flist_t *add_file(metafile_t *m, const char *path,
+		const struct stat *sb)
+{
+	flist_t *new_node;      /* place to store a newly created node */
+
+	if (m->reproducible)
+		check_utf8(path);
+
+	/* the members of a tar file are told once -i and -x are done */
+	if (m->verbose && !m->tar)
+		printf("Adding %s\n", path);
+
+	/* count the total size of the files */
+	m->size += sb->st_size;
+
+	/* create a new file list node for the file */
+	new_node = malloc(sizeof(flist_t));
+	if (new_node == NULL ||
+			(new_node->path = strdup(path)) == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return NULL;
+	}
+	new_node->size = sb->st_size;
+	new_node->pad = 0;
+	new_node->dev = sb->st_dev;
+	new_node->ino = sb->st_ino;
+	new_node->mtime = sb->st_mtime;
+	new_node->ctime = sb->st_ctime;
+	new_node->mtime_nsec = ST_MTIME_NSEC(sb);
+	new_node->ctime_nsec = ST_CTIME_NSEC(sb);
+	new_node->sparse = (off_t) sb->st_blocks * 512 < sb->st_size;
+	new_node->offset = 0;
+	new_node->error = 0;
+	new_node->changed = 0;
+
+	new_node->next = m->file_list;
+	m->file_list = new_node;
+
+	return new_node;
+}
+
+/*
+ * sort the files of list by path with a merge sort. files with paths
+ * that compare the same keep their order, which add_file() made the
+ * reverse of the order we found them in
+ */
+static flist_t *sort_files(metafile_t *m, flist_t *list)
+{
+	flist_t *a = list;      /* the first half of list */
+	flist_t *b;             /* ..and the second */
+	flist_t *fast;
+	flist_t **p = &list;    /* where the next file of the result goes */
+
+	if (list == NULL || list->next == NULL)
+		return list;
+
+	for (fast = list->next; fast && fast->next; fast = fast->next->next)
+		a = a->next;
+	b = a->next;
+	a->next = NULL;
+	a = sort_files(m, list);
+	b = sort_files(m, b);
+
+	while (a && b) {
+		if (m->reproducible ? path_cmp(b->path, a->path) < 0
+				: strcasecmp(b->path, a->path) < 0) {
+			*p = b;
+			b = b->next;
+		} else {
+			*p = a;
+			a = a->next;
+		}
+		p = &(*p)->next;
+	}
+	*p = a ? a : b;
+
+	return list;
+}
+
 /*
  * called by file_tree_walk() on every file and directory in the subtree
  * counts the number of (readable) files, their commulative size and adds
@@ -387,8 +710,6 @@ static int is_dir(metafile_t *m, char *target)
  */
 static int process_node(const char *path, const struct stat *sb, void *data)
 {
-	flist_t **p;            /* pointer to a node in the file list */
-	flist_t *new_node;      /* place to store a newly created node */
 	metafile_t *m = data;
 
 	/* skip non-regular files */
@@ -398,6 +719,9 @@ static int process_node(const char *path, const struct stat *sb, void *data)
 	/* ignore the leading "./" */
 	path += 2;
 
+	if (m->include && !pattern_match(m->include, path, strlen(path)))
+		return 0;
+
 	/* now path should be readable otherwise
 	 * display a warning and skip it */
 	if (access(path, R_OK)) {
@@ -405,37 +729,294 @@ static int process_node(const char *path, const struct stat *sb, void *data)
 		return 0;
 	}
 
-	if (m->verbose)
-		printf("Adding %s\n", path);
+	return add_file(m, path, sb) ? 0 : -1;
+}
 
-	/* count the total size of the files */
-	m->size += sb->st_size;
+/*
+ * called by file_tree_walk() on every file and directory in the subtree
+ * before it looks at it, to leave out what matches -x. a directory left
+ * out is never opened, so nothing in it is looked at either
+ */
+static int skip_node(const char *path, void *data)
+{
+	metafile_t *m = data;
 
-	/* find where to insert the new node so that the file list
-	   remains ordered by the path */
-	p = &m->file_list;
-	while (*p && strcasecmp(path, (*p)->path) > 0)
-		p = &((*p)->next);
+	/* ignore the leading "./" */
+	path += 2;
 
-	/* create a new file list node for the file */
-	new_node = malloc(sizeof(flist_t));
-	if (new_node == NULL ||
-			(new_node->path = strdup(path)) == NULL) {
-		fprintf(stderr, "Out of memory.\n");
-		return -1;
+	return pattern_match(m->exclude, path, strlen(path));
+}
+
+/*
+ * the name a member of a tar file is extracted to. members are often
+ * called ./something, and some /something
+ */
+static const char *member_path(const char *path)
+{
+	while (path[0] == DIRSEP[0]
+			|| (path[0] == '.' && path[1] == DIRSEP[0]))
+		path += path[0] == '.' ? 2 : 1;
+
+	return path;
+}
+
+/*
+ * called by tar_walk() on every member of the tar file, which is added
+ * to the file list under the name it would be extracted to, along with
+ * where its contents are in the tar file. a hard link gets the contents
+ * of the member it links to
+ */
+static int process_member(const char *path, const char *link,
+		const struct stat *sb, off_t offset, void *data)
+{
+	metafile_t *m = data;
+	struct stat st = *sb;
+	flist_t **p;
+	flist_t *f;
+	long mtime_nsec = ST_MTIME_NSEC(sb);
+	const char *s;
+
+	/* skip directories and such */
+	if (!S_ISREG(sb->st_mode))
+		return 0;
+
+	path = member_path(path);
+	if (*path == '\0')
+		return 0;
+
+	if (link) {
+		link = member_path(link);
+		for (f = m->file_list; f && strcmp(f->path, link);
+				f = f->next);
+		if (f == NULL) {
+			fprintf(stderr, "Warning: Skipping '%s', which is "
+				"a link to '%s' we don't have.\n",
+				path, link);
+			return 0;
+		}
+		st.st_size = f->size;
+		st.st_mtime = f->mtime;
+		st.st_blocks = (f->size + 511) / 512;
+		offset = f->offset;
+		mtime_nsec = f->mtime_nsec;
 	}
-	new_node->size = sb->st_size;
 
-	/* now insert the node there */
-	new_node->next = *p;
-	*p = new_node;
+	/* leave out what wouldn't be extracted in the directory */
+	for (s = path; ; s++) {
+		if (s[0] == '.' && s[1] == '.'
+				&& (s[2] == '\0' || s[2] == DIRSEP[0])) {
+			fprintf(stderr, "Warning: Skipping '%s', which is "
+				"outside the directory.\n", path);
+			return 0;
+		}
+		if ((s = strchr(s, DIRSEP[0])) == NULL)
+			break;
+	}
+
+	/* a member given again replaces the one before it,
+	   like it does when extracting */
+	for (p = &m->file_list; *p; p = &(*p)->next)
+		if (strcmp((*p)->path, path) == 0) {
+			f = *p;
+			*p = f->next;
+			m->size -= f->size;
+			free(f->path);
+			free(f);
+			break;
+		}
+
+	f = add_file(m, path, &st);
+	if (f == NULL)
+		return -1;
+	f->offset = offset;
+	f->mtime_nsec = mtime_nsec;
 
-	/* insertion sort is a really stupid way of sorting a list,
-	   but usually a torrent doesn't contain too many files,
-	   so we'll probably be alright ;) */
 	return 0;
 }
 
+/*
+ * a tar file of a directory usually has everything under that directory,
+ * which the torrent is named after. leave it out of the paths, so we
+ * make the same torrent as from the directory itself
+ */
+static void strip_top_dir(metafile_t *m)
+{
+	size_t len = strlen(m->torrent_name);
+	flist_t *f;
+
+	for (f = m->file_list; f; f = f->next)
+		if (strncmp(f->path, m->torrent_name, len)
+				|| f->path[len] != DIRSEP[0])
+			return;
+
+	for (f = m->file_list; f; f = f->next)
+		memmove(f->path, f->path + len + 1,
+				strlen(f->path + len + 1) + 1);
+}
+
+/*
+ * leave out the members of a tar file that -i and -x say we should,
+ * which are all in the tar file anyway, so there is nothing to prune.
+ * a member is left out when a directory above it matches -x too
+ */
+static void filter_members(metafile_t *m)
+{
+	flist_t **p = &m->file_list;
+	flist_t *f;
+
+	while ((f = *p)) {
+		const char *s = f->path;
+		int out = m->include
+			&& !pattern_match(m->include, f->path, strlen(f->path));
+
+		while (!out && s) {
+			s = strchr(s + 1, DIRSEP[0]);
+			out = pattern_match(m->exclude, f->path,
+					s ? (size_t) (s - f->path)
+					: strlen(f->path));
+		}
+
+		if (!out) {
+			p = &f->next;
+			continue;
+		}
+
+		*p = f->next;
+		m->size -= f->size;
+		free(f->path);
+		free(f);
+	}
+}
+
+#ifdef USE_PTHREADS
+#ifdef __linux__
+/*
+ * read the CPU quota from a cgroup v2 cpu.max or a pair of
+ * cgroup v1 cfs files and return the number of CPUs it amounts to,
+ * or -1 if there is no limit
+ */
+static long read_cpu_quota(const char *max, const char *quota,
+		const char *period)
+{
+	FILE *f;
+	long q = -1;
+	long p = 0;
+
+	if (max) {
+		if ((f = fopen(max, "r")) == NULL)
+			return -1;
+		if (fscanf(f, "%ld %ld", &q, &p) != 2)
+			q = -1;
+		fclose(f);
+	} else {
+		if ((f = fopen(quota, "r")) == NULL)
+			return -1;
+		if (fscanf(f, "%ld", &q) != 1)
+			q = -1;
+		fclose(f);
+		if ((f = fopen(period, "r")) == NULL)
+			return -1;
+		if (fscanf(f, "%ld", &p) != 1)
+			p = 0;
+		fclose(f);
+	}
+
+	if (q <= 0 || p <= 0)
+		return -1;
+
+	return (q + p - 1) / p;
+}
+
+/*
+ * find the tightest CPU quota of the cgroup we're in and its parents
+ */
+static long cgroup_cpus()
+{
+	char line[1024];
+	char path[1024 + 32];
+	long n = -1;
+	long c;
+	FILE *f;
+
+	/* cgroup v2 lists our cgroup as "0::<path>" */
+	f = fopen("/proc/self/cgroup", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			char *cg;
+
+			if (strncmp(line, "0::", 3))
+				continue;
+
+			cg = line + 3;
+			cg[strcspn(cg, "\n")] = '\0';
+			while (1) {
+				if (strcmp(cg, "/") == 0)
+					cg[0] = '\0';
+				snprintf(path, sizeof(path),
+					"/sys/fs/cgroup%s/cpu.max", cg);
+				c = read_cpu_quota(path, NULL, NULL);
+				if (c > 0 && (n < 0 || c < n))
+					n = c;
+				if (*cg == '\0' || strrchr(cg, '/') == NULL)
+					break;
+				*strrchr(cg, '/') = '\0';
+			}
+		}
+		fclose(f);
+	}
+
+	c = read_cpu_quota(NULL, "/sys/fs/cgroup/cpu/cpu.cfs_quota_us",
+			"/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+	if (c > 0 && (n < 0 || c < n))
+		n = c;
+
+	return n;
+}
+#endif /* __linux__ */
+
+/*
+ * count the CPUs we may actually run on, taking our affinity mask and
+ * any cgroup CPU quota into account, so we neither oversubscribe a
+ * container nor leave cores of a big machine idle
+ */
+static long count_cpus()
+{
+	long n = -1;
+#ifdef _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+#ifdef __linux__
+#ifdef SYS_sched_getaffinity
+	{
+		unsigned long mask[64];
+		long r = syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask);
+
+		if (r > 0) {
+			long c = 0;
+			long i;
+
+			for (i = 0; i < r / (long) sizeof(unsigned long); i++) {
+				unsigned long w = mask[i];
+
+				for (; w; w &= w - 1)
+					c++;
+			}
+			if (c > 0)
+				n = c;
+		}
+	}
+#endif
+	{
+		long q = cgroup_cpus();
+
+		if (q > 0 && (n < 1 || q < n))
+			n = q;
+	}
+#endif /* __linux__ */
+	return n;
+}
+#endif /* USE_PTHREADS */
+
 /*
  * 'elp!
  */
@@ -452,35 +1033,98 @@ static void print_help()
 	  "                                additional -a adds backup trackers\n"
 	  "-c, --comment=<comment>       : add a comment to the metainfo\n"
 	  "-d, --no-date                 : don't write the creation date\n"
+	  "-B, --bench-hash              : check SHA-1 against its test vectors and\n"
+	  "                                measure how fast it hashes pieces of the\n"
+	  "                                -l length, or of 2^15 to 2^24 bytes, in\n"
+	  "                                1, 2, 4.. up to -t threads, then stop\n"
 	);
+#ifdef USE_PTHREADS
 	printf(
+	  "-b, --block-order             : read pieces in the order they are stored\n"
+	  "                                on disk to save seeks on spinning disks\n"
+	);
+#endif				/* USE_PTHREADS */
+	printf(
+	  "-D, --dry-run                 : print the piece length, the size of the\n"
+	  "                                metainfo file and how long hashing should\n"
+	  "                                take, but don't hash or write anything\n"
+	  "-E, --edit                    : edit the metainfo file given instead of the\n"
+	  "                                contents, keeping its pieces so nothing\n"
+	  "                                is rehashed. -a, -c, -e, -n, -p, -u and -w\n"
+	  "                                replace what is in the file\n"
 	  "-e, --extra=<key:value>       : extra optional info dictionary fields\n"
 	  "                                value can be a string or integer, for example\n"
 	  "                                sourced:from_monkeys or version:i87e\n"
 	  "-f, --force                   : overwrite existing metainfo file\n"
+	  "-H, --hash-cache=<file>       : look up the hashes of files in <file> and\n"
+	  "                                add the ones we had to read to it\n"
 	  "-h, --help                    : show this help screen\n"
+	  "-I, --io=<method>             : get at the files with read, the default,\n"
+	  "                                pread, direct to bypass the page cache,\n"
 	);
+#ifdef USE_IO_URING
 	printf(
-	  "-l, --piece-length=<n>        : set the piece length to 2^n bytes,\n"
-	  "                                default is calculated from the total size\n"
+	  "                                io_uring to queue all reads of a piece,\n"
+	);
+#endif
+	printf(
+	  "                                or mmap to hash pieces where they are\n"
+	);
+	printf(
+	  "-i, --include=<pattern>       : only put the files matching the shell\n"
+	  "                                pattern in the torrent, like '*.mkv'.\n"
+	  "                                a pattern with a / is matched against\n"
+	  "                                the path. additional -i adds more\n"
+	  "-k, --keep-going              : leave out files that can't be read and\n"
+	  "                                hash again what follows them, instead\n"
+	  "                                of giving up, and list them at the end\n"
+	  "-l, --piece-length=<n>[,..]   : set the piece length to 2^n bytes,\n"
+	  "                                default is calculated from the total size.\n"
+	  "                                several make a metainfo file each, named\n"
+	  "                                <name>.<n>.torrent, reading the files once\n"
+	  "-m, --magnet                  : print the infohash and a magnet link\n"
 	  "-n, --name=<name>             : set the name of the torrent\n"
 	  "                                default is the basename of the target\n"
 	  "-o, --output=<filename>       : set the path and filename of the created file\n"
 	);
 	printf(
 	  "                                default is <name>.torrent\n"
+	  "-P, --pad                     : pad files with zeros up to the next piece\n"
+	  "                                boundary, so no piece spans two files\n"
 	  "-p, --private                 : set the private flag\n"
+	  "-R, --reproducible            : make the same metainfo file from the same\n"
+	  "                                contents every time: sort files bytewise,\n"
+	  "                                leave out the date and the version\n"
+	  "-r, --readahead=<n>           : open <n> files ahead of the one being read\n"
+	  "                                and start reading them, default is %d\n"
+	  "-s, --sync                    : make sure the metainfo file is on disk\n"
+	  "                                before we exit\n"
+	  "-T, --tar                     : the target is a tar file, make the torrent\n"
+	  "                                of what is in it without extracting it\n",
+	  READAHEAD
 	);
 #ifdef USE_PTHREADS
 	printf(
 	  "-t, --threads=<n>             : use <n> threads for calculating hashes\n"
 	  "                                default is the number of CPU cores\n"
+	  "                                available to us\n"
+	  "-A, --adaptive-threads        : vary the number of threads hashing up to\n"
+	  "                                the -t limit depending on whether reading\n"
+	  "                                or hashing holds things up\n"
+	  "-C, --cache-resident          : let every thread read and hash whole pieces\n"
+	  "                                a chunk at a time, so the data is hashed\n"
+	  "                                while it is still in the CPU cache\n"
 	);
 #endif				/* USE_PTHREADS */
 	printf(
+	  "-u, --public                  : clear the private flag when editing\n"
 	  "-v, --verbose                 : be verbose\n"
 	  "-w, --web-seed=<url>[,<url>]* : add web seed URLs\n"
 	  "                                additional -w adds more URLs\n"
+	  "-x, --exclude=<pattern>       : leave out the files and directories\n"
+	  "                                matching the shell pattern, like '*.nfo',\n"
+	  "                                without looking into the directories.\n"
+	  "                                additional -x adds more\n"
 	);
 #else				/* USE_LONG_OPTIONS */
 	printf(
@@ -489,35 +1133,98 @@ static void print_help()
 	  "                    additional -a adds backup trackers\n"
 	  "-c <comment>      : add a comment to the metainfo\n"
 	  "-d                : don't write the creation date\n"
+	  "-B                : check SHA-1 against its test vectors and\n"
+	  "                    measure how fast it hashes pieces of the\n"
+	  "                    -l length, or of 2^15 to 2^24 bytes, in\n"
+	  "                    1, 2, 4.. up to -t threads, then stop\n"
+	);
+#ifdef USE_PTHREADS
+	printf(
+	  "-b                : read pieces in the order they are stored\n"
+	  "                    on disk to save seeks on spinning disks\n"
 	);
+#endif				/* USE_PTHREADS */
 	printf(
+	  "-D                : print the piece length, the size of the\n"
+	  "                    metainfo file and how long hashing should\n"
+	  "                    take, but don't hash or write anything\n"
+	  "-E                : edit the metainfo file given instead of the\n"
+	  "                    contents, keeping its pieces so nothing\n"
+	  "                    is rehashed. -a, -c, -e, -n, -p, -u and -w\n"
+	  "                    replace what is in the file\n"
 	  "-e <key:value>    : extra optional info dictionary fields\n"
 	  "                    value can be a string or integer, for example\n"
 	  "                    sourced:from_monkeys or version:i87e\n"
 	  "-f                : overwrite existing metainfo file\n"
+	  "-H <file>         : look up the hashes of files in <file> and\n"
+	  "                    add the ones we had to read to it\n"
 	  "-h                : show this help screen\n"
+	  "-I <method>       : get at the files with read, the default,\n"
+	  "                    pread, direct to bypass the page cache,\n"
+	);
+#ifdef USE_IO_URING
+	printf(
+	  "                    io_uring to queue all reads of a piece,\n"
 	);
+#endif
 	printf(
-	  "-l <n>            : set the piece length to 2^n bytes,\n"
-	  "                    default is calculated from the total size\n"
+	  "                    or mmap to hash pieces where they are\n"
+	);
+	printf(
+	  "-i <pattern>      : only put the files matching the shell\n"
+	  "                    pattern in the torrent, like '*.mkv'.\n"
+	  "                    a pattern with a / is matched against\n"
+	  "                    the path. additional -i adds more\n"
+	  "-k                : leave out files that can't be read and\n"
+	  "                    hash again what follows them, instead\n"
+	  "                    of giving up, and list them at the end\n"
+	  "-l <n>[,..]       : set the piece length to 2^n bytes,\n"
+	  "                    default is calculated from the total size.\n"
+	  "                    several make a metainfo file each, named\n"
+	  "                    <name>.<n>.torrent, reading the files once\n"
+	  "-m                : print the infohash and a magnet link\n"
 	  "-n <name>         : set the name of the torrent,\n"
 	  "                    default is the basename of the target\n"
 	  "-o <filename>     : set the path and filename of the created file\n"
 	);
 	printf(
 	  "                    default is <name>.torrent\n"
+	  "-P                : pad files with zeros up to the next piece\n"
+	  "                    boundary, so no piece spans two files\n"
 	  "-p                : set the private flag\n"
+	  "-R                : make the same metainfo file from the same\n"
+	  "                    contents every time: sort files bytewise,\n"
+	  "                    leave out the date and the version\n"
+	  "-r <n>            : open <n> files ahead of the one being read\n"
+	  "                    and start reading them, default is %d\n"
+	  "-s                : make sure the metainfo file is on disk\n"
+	  "                    before we exit\n"
+	  "-T                : the target is a tar file, make the torrent\n"
+	  "                    of what is in it without extracting it\n",
+	  READAHEAD
 	);
 #ifdef USE_PTHREADS
 	printf(
 	  "-t <n>            : use <n> threads for calculating hashes\n"
 	  "                    default is the number of CPU cores\n"
+	  "                    available to us\n"
+	  "-A                : vary the number of threads hashing up to\n"
+	  "                    the -t limit depending on whether reading\n"
+	  "                    or hashing holds things up\n"
+	  "-C                : let every thread read and hash whole pieces\n"
+	  "                    a chunk at a time, so the data is hashed\n"
+	  "                    while it is still in the CPU cache\n"
 	);
 #endif				/* USE_PTHREADS */
 	printf(
+	  "-u                : clear the private flag when editing\n"
 	  "-v                : be verbose\n"
 	  "-w <url>[,<url>]* : add web seed URLs\n"
 	  "                    additional -w adds more URLs\n"
+	  "-x <pattern>      : leave out the files and directories\n"
+	  "                    matching the shell pattern, like '*.nfo',\n"
+	  "                    without looking into the directories.\n"
+	  "                    additional -x adds more\n"
 	);
 #endif				/* USE_LONG_OPTIONS */
 	printf(
@@ -559,6 +1266,19 @@ static void print_web_seed_list(slist_t *list)
 		printf("                %s\n", list->s);
 }
 
+/*
+ * print the patterns of -i or -x, if there are any
+ */
+static void print_patterns(const char *title, pattern_t *p)
+{
+	if (p == NULL)
+		return;
+
+	printf("  %-13s %s\n", title, p->glob);
+	for (p = p->next; p; p = p->next)
+		printf("                %s\n", p->glob);
+}
+
 /*
  * print the extra user specified info dictionary fields
  */
@@ -616,6 +1336,8 @@ static void print_extra(elist_t *extra)
  */
 static void dump_options(metafile_t *m)
 {
+	plist_t *l;
+
 	printf("Options:\n"
 	       "  Announce URLs:\n");
 
@@ -624,6 +1346,10 @@ static void dump_options(metafile_t *m)
 	printf("  Torrent name: %s\n"
 	       "  Metafile:     %s\n",
 	       m->torrent_name, m->metainfo_file_path);
+	for (l = m->lengths; l; l = l->next)
+		printf("                %s\n", l->metainfo_file_path);
+	if (m->tar)
+		printf("  Tar file:     %s\n", m->tar);
 
 	printf("  Overwrite:    ");
 	if (m->force)
@@ -638,15 +1364,49 @@ static void dump_options(metafile_t *m)
 		printf("no\n");
 
 	printf("  Piece length: ");
-	if (m->piece_length)
-		printf("%u\n", m->piece_length);
-	else
+	if (m->piece_length) {
+		printf("%u", m->piece_length);
+		for (l = m->lengths; l; l = l->next)
+			printf(", %u", l->piece_length);
+		printf("\n");
+	} else
 		printf("automatic\n");
 
 #ifdef USE_PTHREADS
-	printf("  Threads:      %ld\n",
-	       m->threads);
+	printf("  Threads:      %ld%s\n",
+	       m->threads, m->adaptive_threads ? " at most" : "");
+	printf("  Read order:   ");
+	if (m->block_order)
+		printf("disk blocks\n");
+	else
+		printf("files\n");
+	printf("  Hash while:   ");
+	if (m->cache_resident)
+		printf("reading\n");
+	else
+		printf("reading ahead\n");
 #endif
+	printf("  Reading with: %s\n", io_names[m->io]);
+	printf("  Keep going:   ");
+	if (m->keep_going)
+		printf("yes\n");
+	else
+		printf("no\n");
+	printf("  Readahead:    %u files\n", m->readahead);
+	printf("  Reproducible: ");
+	if (m->reproducible)
+		printf("yes\n");
+	else
+		printf("no\n");
+	printf("  Padding:      ");
+	if (m->pad)
+		printf("yes\n");
+	else
+		printf("no\n");
+	printf("  Hash cache:   %s\n",
+	       m->hash_cache ? m->hash_cache : "none");
+	print_patterns("Include:", m->include);
+	print_patterns("Exclude:", m->exclude);
 	printf("  Be verbose:   yes\n"
 	       "  Write date:   ");
 	if (m->no_creation_date)
@@ -669,16 +1429,38 @@ static void dump_options(metafile_t *m)
 }
 
 /*
- * parse and check the command line options given
- * and fill out the appropriate fields of the
- * metafile structure
+ * pad every file followed by another one that isn't empty with zeros
+ * up to the next piece boundary, so no piece holds parts of two files
  */
-EXPORT void init(metafile_t *m, int argc, char *argv[])
+static void pad_files(metafile_t *m)
+{
+	flist_t *f;
+	flist_t *last = NULL;
+	int64_t off = 0;
+
+	for (f = m->file_list; f; f = f->next)
+		if (f->size)
+			last = f;
+
+	for (f = m->file_list; f != last; f = f->next) {
+		off += f->size;
+		if (off % m->piece_length) {
+			f->pad = m->piece_length - off % m->piece_length;
+			off += f->pad;
+			m->size += f->pad;
+		}
+	}
+}
+
+/*
+ * scan the target file or directory and work out the piece length
+ * and the number of pieces
+ */
+static void read_target(metafile_t *m, char *target)
 {
-	int c;			/* return value of getopt() */
 	int i;			/* loop iterator */
-	llist_t *announce_last = NULL;
-	slist_t *web_seed_last = NULL;
+	plist_t *l;		/* other piece lengths */
+	flist_t *f;		/* a member of a tar file */
 	int64_t piece_len_maxes[] = {
 		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 		(int64_t) BIT15MAX * ONEMEG, (int64_t) BIT16MAX * ONEMEG,
@@ -689,36 +1471,124 @@ EXPORT void init(metafile_t *m, int argc, char *argv[])
 	};
 	int num_piece_len_maxes = sizeof(piece_len_maxes) /
 	    sizeof(piece_len_maxes[0]);
+#ifdef DEBUG
+	int64_t pieces;
+#endif				/* DEBUG */
+
+	/* check if target is a tar file, a directory or just a single file */
+	if (m->tar) {
+		/* the members of a tar file make a directory of files */
+		m->target_is_directory = 1;
+		if (tar_walk(target, process_member, m))
+			exit(EXIT_FAILURE);
+		m->file_list = sort_files(m, m->file_list);
+		strip_top_dir(m);
+		if (m->include || m->exclude)
+			filter_members(m);
+		if (m->verbose)
+			for (f = m->file_list; f; f = f->next)
+				printf("Adding %s\n", f->path);
+	} else if ((m->target_is_directory = is_dir(m, target))) {
+		/* change to the specified directory */
+		if (chdir(target)) {
+			fprintf(stderr, "Error changing directory to '%s': %s\n",
+					target, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		if (file_tree_walk("." DIRSEP, MAX_OPENFD, process_node,
+					m->exclude ? skip_node : NULL, m))
+			exit(EXIT_FAILURE);
+		m->file_list = sort_files(m, m->file_list);
+	}
+
+	/* determine the piece length based on the torrent size if
+	   it was not user specified. */
+	if (m->piece_length == 0) {
+		for (i = 15; i < num_piece_len_maxes &&
+		     m->piece_length == 0; i++)
+			if (m->size <= piece_len_maxes[i])
+				m->piece_length = i;
+		if (m->piece_length == 0)
+			m->piece_length = i;
+	}
+	/* convert the piece length from power of 2 to an integer. */
+	m->piece_length = 1 << m->piece_length;
+	for (l = m->lengths; l; l = l->next)
+		l->piece_length = 1 << l->piece_length;
+
+	if (m->pad)
+		pad_files(m);
+
+	/* calculate the number of pieces
+	   pieces = ceil( size / piece_length ) */
+#ifdef DEBUG
+	pieces = m->size + m->piece_length - 1;
+	fprintf(stderr, PROGRAM ": size + pl - 1 = %" PRId64 "\n", pieces);
+#endif				/* DEBUG */
+	m->pieces = (m->size + m->piece_length - 1) / m->piece_length;
+}
+
+/*
+ * parse and check the command line options given
+ * and fill out the appropriate fields of the
+ * metafile structure
+ */
+EXPORT void init(metafile_t *m, int argc, char *argv[])
+{
+	int c;			/* return value of getopt() */
+	int i;			/* loop iterator */
+	int tar = 0;		/* the target is a tar file */
+	plist_t *l;		/* other piece lengths */
+	llist_t *announce_last = NULL;
+	slist_t *web_seed_last = NULL;
 #ifdef USE_LONG_OPTIONS
 	/* the option structure to pass to getopt_long() */
 	static struct option long_options[] = {
 		{"announce", 1, NULL, 'a'},
+		{"bench-hash", 0, NULL, 'B'},
+#ifdef USE_PTHREADS
+		{"block-order", 0, NULL, 'b'},
+#endif
 		{"comment", 1, NULL, 'c'},
 		{"no-date", 0, NULL, 'd'},
+		{"dry-run", 0, NULL, 'D'},
+		{"edit", 0, NULL, 'E'},
+		{"exclude", 1, NULL, 'x'},
 		{"extra", 1, NULL, 'e'},
 		{"force", 0, NULL, 'f'},
+		{"hash-cache", 1, NULL, 'H'},
 		{"help", 0, NULL, 'h'},
+		{"include", 1, NULL, 'i'},
+		{"io", 1, NULL, 'I'},
+		{"keep-going", 0, NULL, 'k'},
 		{"piece-length", 1, NULL, 'l'},
+		{"magnet", 0, NULL, 'm'},
 		{"name", 1, NULL, 'n'},
 		{"output", 1, NULL, 'o'},
+		{"pad", 0, NULL, 'P'},
 		{"private", 0, NULL, 'p'},
+		{"public", 0, NULL, 'u'},
+		{"readahead", 1, NULL, 'r'},
+		{"reproducible", 0, NULL, 'R'},
+		{"sync", 0, NULL, 's'},
+		{"tar", 0, NULL, 'T'},
 #ifdef USE_PTHREADS
 		{"threads", 1, NULL, 't'},
+		{"adaptive-threads", 0, NULL, 'A'},
+		{"cache-resident", 0, NULL, 'C'},
 #endif
 		{"verbose", 0, NULL, 'v'},
 		{"web-seed", 1, NULL, 'w'},
 		{NULL, 0, NULL, 0}
 	};
 #endif
-#ifdef DEBUG
-	int64_t pieces;
-#endif				/* DEBUG */
 
 	/* now parse the command line options given */
 #ifdef USE_PTHREADS
-#define OPT_STRING "a:c:de:fhl:n:o:pt:vw:"
+#define OPT_STRING "ABCDEH:I:PRTa:bc:de:fhi:kl:mn:o:pr:st:uvw:x:"
 #else
-#define OPT_STRING "a:c:de:fhl:n:o:pvw:"
+#define OPT_STRING "BDEH:I:PRTa:c:de:fhi:kl:mn:o:pr:suvw:x:"
 #endif
 #ifdef USE_LONG_OPTIONS
 	while ((c = getopt_long(argc, argv, OPT_STRING,
@@ -728,6 +1598,14 @@ EXPORT void init(metafile_t *m, int argc, char *argv[])
 #endif
 #undef OPT_STRING
 		switch (c) {
+#ifdef USE_PTHREADS
+		case 'A':
+			m->adaptive_threads = 1;
+			break;
+		case 'C':
+			m->cache_resident = 1;
+			break;
+#endif
 		case 'a':
 			if (announce_last == NULL) {
 				m->announce_list = announce_last =
@@ -744,6 +1622,20 @@ EXPORT void init(metafile_t *m, int argc, char *argv[])
 			}
 			announce_last->l = get_slist(optarg);
 			break;
+#ifdef USE_PTHREADS
+		case 'b':
+			m->block_order = 1;
+			break;
+#endif
+		case 'B':
+			m->bench = 1;
+			break;
+		case 'D':
+			m->dry_run = 1;
+			break;
+		case 'E':
+			m->edit = 1;
+			break;
 		case 'c':
 			m->comment = optarg;
 			break;
@@ -756,19 +1648,40 @@ EXPORT void init(metafile_t *m, int argc, char *argv[])
 		case 'f':
 			m->force = 1;
 			break;
+		case 'H':
+			m->hash_cache = optarg;
+			break;
+		case 'I':
+			for (i = 0; i < IO_METHODS
+					&& strcmp(optarg, io_names[i]); i++);
+			if (i == IO_METHODS) {
+				fprintf(stderr, PROGRAM
+					": Invalid I/O method %s\n", optarg);
+#ifdef USE_IO_URING
+				fprintf(stderr, "The I/O method must be read,"
+					" pread, direct, io_uring or mmap.\n");
+#else
+				fprintf(stderr, "The I/O method must be read,"
+					" pread, direct or mmap.\n");
+#endif
+				exit(EXIT_FAILURE);
+			}
+			m->io = i;
+			break;
 		case 'h':
 			print_help();
 			exit(EXIT_SUCCESS);
+		case 'i':
+			pattern_add(&m->include, optarg);
+			break;
+		case 'k':
+			m->keep_going = 1;
+			break;
 		case 'l':
-			m->piece_length = atoi(optarg);
-			if (m->piece_length < 15 || m->piece_length > 28) {
-				fprintf(stderr, PROGRAM
-					": Invalid piece length %s\n",
-					optarg);
-				fprintf(stderr, "The piece length must be"
-					" a number between 15 and 28.\n");
-				exit(EXIT_FAILURE);
-			}
+			read_piece_lengths(m, optarg);
+			break;
+		case 'm':
+			m->magnet = 1;
 			break;
 		case 'n':
 			m->torrent_name = optarg;
@@ -776,14 +1689,42 @@ EXPORT void init(metafile_t *m, int argc, char *argv[])
 		case 'o':
 			m->metainfo_file_path = optarg;
 			break;
+		case 'P':
+			m->pad = 1;
+			break;
 		case 'p':
 			m->private = 1;
 			break;
+		case 'R':
+			m->reproducible = 1;
+			m->no_creation_date = 1;
+			break;
+		case 'u':
+			m->private = -1;
+			break;
+		case 'r':
+			i = atoi(optarg);
+			if (i < 0 || i > MAX_OPENFD) {
+				fprintf(stderr, PROGRAM
+					": Invalid readahead %s\n", optarg);
+				fprintf(stderr, "The readahead must be"
+					" a number between 0 and %d.\n",
+					MAX_OPENFD);
+				exit(EXIT_FAILURE);
+			}
+			m->readahead = i;
+			break;
 #ifdef USE_PTHREADS
 		case 't':
 			m->threads = atoi(optarg);
 			break;
 #endif
+		case 's':
+			m->sync = 1;
+			break;
+		case 'T':
+			tar = 1;
+			break;
 		case 'v':
 			m->verbose = 1;
 			break;
@@ -799,100 +1740,291 @@ EXPORT void init(metafile_t *m, int argc, char *argv[])
 			while (web_seed_last->next)
 				web_seed_last = web_seed_last->next;
 			break;
+		case 'x':
+			pattern_add(&m->exclude, optarg);
+			break;
 		case '?':
 			fprintf(stderr, "Use -h for help.\n");
 			exit(EXIT_FAILURE);
 		}
 	}
 
-	/* user must specify at least one announce URL as it wouldn't make
-	   any sense to have a default for this.
-	   it is ok not to have any unless torrent is private. */
-	if (m->announce_list == NULL && m->private == 1) {
-		fprintf(stderr, "Must specify an announce URL. "
-			"Use -h for help.\n");
-		exit(EXIT_FAILURE);
-	}
 	if (announce_last != NULL)
 		announce_last->next = NULL;
 
-	/* ..and a file or directory from which to create the torrent */
-	if (optind >= argc) {
-		fprintf(stderr, "Must specify the contents, "
-			"use -h for help\n");
+	/* user must specify a file or directory from which to create
+	   the torrent, or the metainfo file to edit */
+	if (optind >= argc && !m->bench) {
+		if (m->edit)
+			fprintf(stderr, "Must specify the metainfo file "
+				"to edit, use -h for help\n");
+		else
+			fprintf(stderr, "Must specify the contents, "
+				"use -h for help\n");
 		exit(EXIT_FAILURE);
 	}
 
 #ifdef USE_PTHREADS
 	/* check the number of threads */
-	if (m->threads) {
-		if (m->threads > 20) {
-			fprintf(stderr, "The number of threads is limited to "
-			                "at most 20\n");
+	if (m->threads < 0) {
+		fprintf(stderr, "The number of threads must be positive\n");
+		exit(EXIT_FAILURE);
+	} else if (m->threads == 0) {
+		m->threads = count_cpus();
+		if (m->threads < 1)
+			m->threads = 2; /* some sane default */
+	}
+
+	/* mapped pieces are hashed by the threads mapping them */
+	if (m->io == IO_MMAP)
+		m->cache_resident = 1;
+
+	/* every thread both reads and hashes, so there
+	   are no readers or hashers to balance */
+	if (m->cache_resident)
+		m->adaptive_threads = 0;
+#endif
+
+	/* there's nothing to read when benchmarking */
+	if (m->bench)
+		return;
+
+	if (m->edit) {
+		/* the pieces we copy are only valid for
+		   the piece length they were hashed with */
+		if (m->piece_length) {
+			fprintf(stderr, "The piece length of a torrent "
+				"can't be changed without rehashing.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (m->pad) {
+			fprintf(stderr, "Padding can't be added to a torrent "
+				"without rehashing.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (tar) {
+			fprintf(stderr, "A tar file can't be given "
+				"when editing.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (m->include || m->exclude) {
+			fprintf(stderr, "Files can't be left out of a torrent "
+				"without rehashing.\n");
 			exit(EXIT_FAILURE);
 		}
+
+		/* fill out everything not given on the command line */
+		read_metainfo(m, argv[optind]);
 	} else {
-#ifdef _SC_NPROCESSORS_ONLN
-		m->threads = sysconf(_SC_NPROCESSORS_ONLN);
-		if (m->threads == -1)
-#endif
-			m->threads = 2; /* some sane default */
+		/* strip ending DIRSEP's from target */
+		strip_ending_dirseps(argv[optind]);
+
+		/* if the torrent name isn't set use the basename
+		   of the target, without .tar for a tar file */
+		if (m->torrent_name == NULL)
+			m->torrent_name = tar ? tar_basename(argv[optind])
+				: basename(argv[optind]);
+
+		if (tar) {
+			/* the members of a tar file all share its device
+			   and inode, so the hash cache can't tell them apart */
+			if (m->hash_cache) {
+				fprintf(stderr, "The hash cache can't be "
+					"used with a tar file.\n");
+				exit(EXIT_FAILURE);
+			}
+			m->tar = argv[optind];
+		}
+
+		if (m->lengths) {
+			/* padding depends on the piece length, and the
+			   hash cache only knows the one we hash with */
+			if (m->pad) {
+				fprintf(stderr, "Padding can't be used with "
+					"several piece lengths.\n");
+				exit(EXIT_FAILURE);
+			}
+			if (m->hash_cache) {
+				fprintf(stderr, "The hash cache can't be used "
+					"with several piece lengths.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
 	}
-#endif
 
-	/* strip ending DIRSEP's from target */
-	strip_ending_dirseps(argv[optind]);
+	if (m->reproducible)
+		check_utf8(m->torrent_name);
 
-	/* if the torrent name isn't set use the basename of the target */
-	if (m->torrent_name == NULL)
-		m->torrent_name = basename(argv[optind]);
+	/* -u has done its job of keeping the private flag
+	   of an edited torrent from being read */
+	if (m->private < 0)
+		m->private = 0;
+
+	/* user must specify at least one announce URL as it wouldn't make
+	   any sense to have a default for this.
+	   it is ok not to have any unless torrent is private. */
+	if (m->announce_list == NULL && m->private == 1) {
+		fprintf(stderr, "Must specify an announce URL. "
+			"Use -h for help.\n");
+		exit(EXIT_FAILURE);
+	}
 
 	/* make sure m->metainfo_file_path is the absolute path to the file */
 	set_absolute_file_path(m);
+	if (m->lengths) {
+		for (l = m->lengths; l; l = l->next)
+			l->metainfo_file_path = length_path(
+				m->metainfo_file_path, l->piece_length);
+		m->metainfo_file_path = length_path(m->metainfo_file_path,
+				m->piece_length);
+	}
+	if (m->hash_cache)
+		m->hash_cache = absolute_path(m->hash_cache);
 
 	/* if we should be verbose print out all the options
 	   as we have set them */
 	if (m->verbose)
 		dump_options(m);
 
-	/* check if target is a directory or just a single file */
-	m->target_is_directory = is_dir(m, argv[optind]);
-	if (m->target_is_directory) {
-		/* change to the specified directory */
-		if (chdir(argv[optind])) {
-			fprintf(stderr, "Error changing directory to '%s': %s\n",
-					argv[optind], strerror(errno));
-			exit(EXIT_FAILURE);
+	/* scan the target unless we got everything from the
+	   metainfo file we're editing */
+	if (!m->edit)
+		read_target(m, argv[optind]);
+
+	/* now print the size and piece count if we should be verbose */
+	if (m->verbose)
+		printf("\n%" PRId64 " bytes in all.\n"
+			"That's %u pieces of %u bytes each.\n\n",
+			m->size, m->pieces, m->piece_length);
+}
+
+/*
+ * hard links to a file that changed changed too
+ */
+static void mark_links(metafile_t *m)
+{
+	flist_t *f, *g;
+
+	for (f = m->file_list; f; f = f->next)
+		if (f->changed && f->ino)
+			for (g = m->file_list; g; g = g->next)
+				if (g->ino == f->ino && g->dev == f->dev)
+					g->changed = 1;
+}
+
+/*
+ * after hashing, leave the files we couldn't read out of the torrent
+ * and take another look at the files that changed, then lay out the
+ * pieces again. pieces before the first file that moved the ones after
+ * it, and holding no file that changed, are the same as when we hashed
+ * them, so we mark those to keep their hashes in hash_string. returns
+ * the number of files left out or changed
+ */
+EXPORT unsigned int check_files(metafile_t *m, unsigned char *hash_string)
+{
+	flist_t **p = &m->file_list;
+	flist_t **dropped = &m->dropped;
+	flist_t *prev = NULL;      /* last file we keep before p */
+	int64_t off = 0;           /* offset of *p in the torrent */
+	int64_t same = -1;         /* bytes laid out as before, -1 if all */
+	unsigned int pieces = m->pieces;
+	unsigned char *stale;      /* pieces holding a file that changed */
+	unsigned int n = 0;
+	unsigned int i;
+	flist_t *f;
+
+	stale = calloc(pieces ? pieces : 1, 1);
+	if (stale == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	mark_links(m);
+	while ((f = *p)) {
+		int64_t end = off + f->size + f->pad;
+		struct stat st;
+
+		if (f->changed && f->error == 0) {
+			if (stat(f->path, &st)) {
+				if (!m->keep_going) {
+					fprintf(stderr, "Error stat'ing '%s': "
+						"%s\n", f->path,
+						strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+				f->error = errno;
+			} else {
+				for (i = off / m->piece_length; i < pieces
+						&& (int64_t) i * m->piece_length
+						< end; i++)
+					stale[i] = 1;
+
+				/* the padding in front of it may change */
+				if (st.st_size != f->size && same < 0)
+					same = off - (prev ? prev->pad : 0);
+				f->size = st.st_size;
+				f->mtime = st.st_mtime;
+				f->ctime = st.st_ctime;
+				f->mtime_nsec = ST_MTIME_NSEC(&st);
+				f->ctime_nsec = ST_CTIME_NSEC(&st);
+				f->sparse = (off_t) st.st_blocks * 512
+					< st.st_size;
+				f->changed = 0;
+				n++;
+			}
 		}
 
-		if (file_tree_walk("." DIRSEP, MAX_OPENFD, process_node, m))
-			exit(EXIT_FAILURE);
+		if (f->error == 0) {
+			off = end;
+			prev = f;
+			p = &f->next;
+			continue;
+		}
+
+		if (same < 0)
+			same = off - (prev ? prev->pad : 0);
+		*p = f->next;
+		f->next = NULL;
+		while (*dropped)
+			dropped = &(*dropped)->next;
+		*dropped = f;
+		n++;
 	}
 
-	/* determine the piece length based on the torrent size if
-	   it was not user specified. */
-	if (m->piece_length == 0) {
-		for (i = 15; i < num_piece_len_maxes &&
-		     m->piece_length == 0; i++)
-			if (m->size <= piece_len_maxes[i])
-				m->piece_length = i;
-		if (m->piece_length == 0)
-			m->piece_length = i;
+	if (n == 0) {
+		free(stale);
+		return 0;
 	}
-	/* convert the piece length from power of 2 to an integer. */
-	m->piece_length = 1 << m->piece_length;
 
-	/* calculate the number of pieces
-	   pieces = ceil( size / piece_length ) */
-#ifdef DEBUG
-	pieces = m->size + m->piece_length - 1;
-	fprintf(stderr, PROGRAM ": size + pl - 1 = %" PRId64 "\n", pieces);
-#endif				/* DEBUG */
+	if (m->file_list == NULL) {
+		fprintf(stderr, "None of the files could be read.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	m->size = 0;
+	for (f = m->file_list; f; f = f->next) {
+		f->pad = 0;
+		m->size += f->size;
+	}
+	if (m->pad)
+		pad_files(m);
 	m->pieces = (m->size + m->piece_length - 1) / m->piece_length;
 
-	/* now print the size and piece count if we should be verbose */
-	if (m->verbose)
-		printf("\n%" PRId64 " bytes in all.\n"
-			"That's %u pieces of %u bytes each.\n\n",
-			m->size, m->pieces, m->piece_length);
+	free(m->kept);
+	m->kept = malloc(m->pieces ? m->pieces : 1);
+	if (m->kept == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < m->pieces; i++)
+		m->kept[i] = i < pieces && !stale[i] && (same < 0
+			|| (int64_t) (i + 1) * m->piece_length <= same);
+
+	free(stale);
+	free(m->hash_string);
+	m->hash_string = hash_string;
+
+	return n;
 }
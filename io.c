@@ -0,0 +1,675 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2007, 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef ALLINONE
+#include <stdlib.h>       /* exit(), malloc(), posix_memalign() */
+#include <sys/types.h>    /* off_t */
+#include <sys/stat.h>     /* fstat() */
+#include <errno.h>        /* errno */
+#include <string.h>       /* strerror(), memset(), memcpy() */
+#include <stdio.h>        /* printf() etc. */
+#include <fcntl.h>        /* open(), O_DIRECT */
+#include <unistd.h>       /* lseek(), pread(), close(), sysconf() */
+#include <inttypes.h>     /* PRId64 etc. */
+#include <sys/mman.h>     /* mmap(), munmap() */
+#include <sys/uio.h>      /* struct iovec */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA1() etc. */
+#else
+#include "sha1.h"
+#endif
+
+#include "mktorrent.h"
+#include "prefetch.h"
+
+#define EXPORT
+#endif /* ALLINONE */
+
+#include "io.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifndef OPENFLAGS
+#if defined _LARGEFILE_SOURCE && defined O_LARGEFILE
+#define OPENFLAGS (O_RDONLY | O_BINARY | O_LARGEFILE)
+#else
+#define OPENFLAGS (O_RDONLY | O_BINARY)
+#endif
+#endif
+
+/* glibc only has this with _GNU_SOURCE */
+#if !defined(O_DIRECT) && defined(__O_DIRECT)
+#define O_DIRECT __O_DIRECT
+#endif
+
+/* reads with O_DIRECT start and end on this boundary, and
+   go through a buffer of DIRECT_BUFFER bytes */
+#ifndef DIRECT_ALIGN
+#define DIRECT_ALIGN 4096
+#endif
+#ifndef DIRECT_BUFFER
+#define DIRECT_BUFFER (1 << 20)
+#endif
+
+/* a piece is read with io_uring in requests of this size,
+   so the disk gets all of them at once */
+#ifndef URING_PART
+#define URING_PART (128 << 10)
+#endif
+
+EXPORT void source_init(source_t *s, int method, prefetch_t *pf)
+{
+	memset(s, 0, sizeof(source_t));
+	s->method = method;
+	s->pf = pf;
+	s->fd = -1;
+	s->page = sysconf(_SC_PAGESIZE);
+
+	if (method == IO_DIRECT && posix_memalign((void **) &s->bounce,
+				DIRECT_ALIGN, DIRECT_BUFFER)) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static struct iovec *add_segment(source_t *s, void *base, size_t len)
+{
+	struct iovec *seg;
+
+	if (s->n == s->alloc) {
+		s->alloc = s->alloc ? 2 * s->alloc : 16;
+		s->iov = realloc(s->iov, s->alloc * sizeof(struct iovec));
+		s->maps = realloc(s->maps, s->alloc * sizeof(struct iovec));
+		if (s->iov == NULL || s->maps == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	s->maps[s->n].iov_base = NULL;
+	s->maps[s->n].iov_len = 0;
+	seg = s->iov + s->n++;
+	seg->iov_base = base;
+	seg->iov_len = len;
+
+	return seg;
+}
+
+/*
+ * submit the reads waiting with IO_URING and wait for them
+ */
+static void submit_parts(source_t *s)
+{
+	if (s->nparts)
+		prefetch_read_parts(s->pf, s->parts, s->nparts);
+	s->nparts = 0;
+}
+
+static void close_source(source_t *s)
+{
+	if (s->f == NULL)
+		return;
+
+	submit_parts(s);
+	if (s->fd >= 0) {
+		/* see if it changed while we read it */
+		prefetch_check(s->pf, s->f, s->fd);
+
+		if (!s->direct)
+			prefetch_close(s->pf, s->f, s->fd);
+		else if (close(s->fd)) {
+			fprintf(stderr, "Error closing '%s': %s\n",
+					s->f->path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	s->f = NULL;
+	s->fd = -1;
+}
+
+static void open_source(source_t *s, flist_t *f)
+{
+	struct stat st;
+
+	close_source(s);
+
+	s->f = f;
+	s->pos = 0;
+	s->direct = 0;
+#ifdef O_DIRECT
+	/* file systems that can't bypass the page cache
+	   say so with EINVAL, and are read the usual way */
+	if (s->method == IO_DIRECT) {
+		s->fd = open(s->pf->tar ? s->pf->tar : f->path,
+				OPENFLAGS | O_DIRECT);
+		if (s->fd >= 0)
+			s->direct = 1;
+		else if (errno != EINVAL) {
+			prefetch_fail(s->pf, f, OPEN_ERROR, errno);
+			return;
+		}
+	}
+#endif
+	if (!s->direct && (s->fd = prefetch_open(s->pf, f)) < 0)
+		return;
+	prefetch_check(s->pf, f, s->fd);
+
+	/* touching a mapping past the end of a
+	   file kills us, so go by its size now */
+	if (s->method == IO_MMAP) {
+		s->size = 0;
+		if (fstat(s->fd, &st))
+			prefetch_fail(s->pf, f, "Error stat'ing '%s': %s\n", errno);
+		else
+			s->size = st.st_size;
+	}
+
+	if (s->print_files) {
+		printf("Hashing %s.\n", f->path);
+		fflush(stdout);
+	}
+}
+
+/*
+ * zeros in place of len bytes of a file we couldn't read
+ */
+static void zero_part(source_t *s, unsigned char *buf, size_t len)
+{
+	if (s->method != IO_MMAP)
+		memset(buf, 0, len);
+	else if (len)
+		add_segment(s, NULL, len);
+}
+
+/*
+ * give up on reading the open file after failing with d, or hitting
+ * its end with d == 0, and carry on with zeros if we keep going or it
+ * changed, which has it hashed again
+ */
+static void fail_part(source_t *s, ssize_t d, unsigned char *buf, size_t len)
+{
+	if (d < 0)
+		prefetch_fail(s->pf, s->f, READ_ERROR, errno);
+	else
+		prefetch_shrank(s->pf, s->f, s->fd);
+	zero_part(s, buf, len);
+}
+
+/*
+ * read len bytes at offset off of the open file into buf with read()
+ */
+static void read_part(source_t *s, unsigned char *buf, size_t len, off_t off)
+{
+	int tries = 0;
+
+	/* only seek when we don't continue where we left off */
+	if (s->pos != off) {
+		if (lseek(s->fd, off, SEEK_SET) == -1) {
+			prefetch_fail(s->pf, s->f, "Error seeking in '%s': %s\n", errno);
+			zero_part(s, buf, len);
+			return;
+		}
+		s->pos = off;
+	}
+
+	while (len) {
+		ssize_t d = prefetch_read(s->pf, s->fd, buf, len);
+
+		if (d < 0 && prefetch_retry(s->pf, &tries))
+			continue;
+		if (d <= 0) {
+			fail_part(s, d, buf, len);
+			return;
+		}
+
+		buf += d;
+		len -= d;
+		s->pos += d;
+	}
+}
+
+/*
+ * the same with pread(), which doesn't need the file position
+ */
+static void pread_part(source_t *s, unsigned char *buf, size_t len, off_t off)
+{
+	int tries = 0;
+
+	while (len) {
+		ssize_t d = prefetch_pread(s->pf, s->fd, buf, len, off);
+
+		if (d < 0 && prefetch_retry(s->pf, &tries))
+			continue;
+		if (d <= 0) {
+			fail_part(s, d, buf, len);
+			return;
+		}
+
+		buf += d;
+		len -= d;
+		off += d;
+	}
+}
+
+/*
+ * the same bypassing the page cache, which takes reads of whole aligned
+ * blocks into an aligned buffer we copy the part we want out of
+ */
+static void direct_part(source_t *s, unsigned char *buf, size_t len,
+		off_t off)
+{
+	int tries = 0;
+
+	while (len) {
+		off_t start = off - off % DIRECT_ALIGN;
+		size_t skip = off - start;
+		size_t want = skip + len;
+		size_t n;
+		ssize_t d;
+
+		if (want > DIRECT_BUFFER)
+			want = DIRECT_BUFFER;
+		want += (DIRECT_ALIGN - want % DIRECT_ALIGN) % DIRECT_ALIGN;
+
+		d = prefetch_pread(s->pf, s->fd, s->bounce, want, start);
+		if (d < 0 && prefetch_retry(s->pf, &tries))
+			continue;
+		if (d < 0 || (size_t) d <= skip) {
+			fail_part(s, d < 0 ? d : 0, buf, len);
+			return;
+		}
+
+		n = d - skip < len ? d - skip : len;
+		memcpy(buf, s->bounce + skip, n);
+		buf += n;
+		len -= n;
+		off += n;
+	}
+}
+
+/*
+ * queue the reads of len bytes at offset off of the open file into buf,
+ * to be submitted all at once with IO_URING
+ */
+static void queue_part(source_t *s, unsigned char *buf, size_t len, off_t off)
+{
+	while (len) {
+		part_t *p;
+
+		if (s->nparts == s->parts_alloc) {
+			s->parts_alloc = s->parts_alloc ?
+				2 * s->parts_alloc : 16;
+			s->parts = realloc(s->parts,
+					s->parts_alloc * sizeof(part_t));
+			if (s->parts == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		p = s->parts + s->nparts++;
+		p->f = s->f;
+		p->fd = s->fd;
+		p->off = off;
+		p->buf = buf;
+		p->len = len < URING_PART ? len : URING_PART;
+
+		buf += p->len;
+		off += p->len;
+		len -= p->len;
+	}
+}
+
+/*
+ * map len bytes at offset off of the open file as a segment
+ */
+static void map_part(source_t *s, size_t len, off_t off)
+{
+	off_t start = off - off % s->page;
+	void *map;
+
+	if (off + (off_t) len > s->size) {
+		prefetch_shrank(s->pf, s->f, s->fd);
+		add_segment(s, NULL, len);
+		return;
+	}
+
+	map = mmap(NULL, len + (off - start), PROT_READ, MAP_SHARED,
+			s->fd, start);
+	if (map == MAP_FAILED) {
+		prefetch_fail(s->pf, s->f, "Error mapping '%s': %s\n", errno);
+		add_segment(s, NULL, len);
+		return;
+	}
+	posix_madvise(map, len + (off - start), POSIX_MADV_WILLNEED);
+
+	add_segment(s, (char *) map + (off - start), len);
+	s->maps[s->n - 1].iov_base = map;
+	s->maps[s->n - 1].iov_len = len + (off - start);
+}
+
+/*
+ * get len bytes starting at offset *offp of the file *fp, continuing
+ * into the following files when we hit the end of it, and leave *fp and
+ * *offp where we stopped. the bytes end up in the segments of s, which
+ * are in buf unless they are mapped. returns the number of bytes, which
+ * is less than len only when we run out of files
+ */
+EXPORT size_t source_read(source_t *s, flist_t **fp, off_t *offp,
+		unsigned char *buf, size_t len)
+{
+	flist_t *f = *fp;
+	off_t off = *offp;
+	size_t r = 0;
+
+	s->n = 0;
+	while (r < len && f) {
+		unsigned int k;
+		size_t n;
+
+		/* read runs of small files that fit in the rest
+		   of the piece in one go */
+		if (s->method != IO_MMAP && off == 0
+				&& (k = prefetch_small_files(f, len - r))) {
+			r += prefetch_read_small(s->pf, f, k, buf + r);
+			for (; k; k--, f = f->next)
+				if (s->print_files)
+					printf("Hashing %s.\n", f->path);
+			fflush(stdout);
+			continue;
+		}
+
+		/* the padding following a file is zeros we don't have
+		   to read, a segment without a base when mapping */
+		if (off >= f->size) {
+			if (off == 0 && s->print_files)
+				printf("Hashing %s.\n", f->path);
+
+			n = f->size + f->pad - off < (off_t) (len - r) ?
+				(size_t) (f->size + f->pad - off) : len - r;
+			if (s->method != IO_MMAP)
+				memset(buf + r, 0, n);
+			else if (n)
+				add_segment(s, NULL, n);
+			r += n;
+			off += n;
+
+			if (off >= f->size + f->pad) {
+				f = f->next;
+				off = 0;
+			}
+			continue;
+		}
+
+		if (s->f != f)
+			open_source(s, f);
+
+		n = f->size - off < (off_t) (len - r) ?
+			(size_t) (f->size - off) : len - r;
+		if (f->error || f->changed) {
+			/* we gave up on it and keep going, or
+			   it changed and we'll hash it again */
+			zero_part(s, buf + r, n);
+			r += n;
+			off += n;
+			continue;
+		}
+
+		/* members of a tar file start at their offset in it */
+		switch (s->method) {
+		case IO_MMAP:
+			map_part(s, n, f->offset + off);
+			break;
+		case IO_PREAD:
+			pread_part(s, buf + r, n, f->offset + off);
+			break;
+		case IO_DIRECT:
+			if (s->direct)
+				direct_part(s, buf + r, n, f->offset + off);
+			else
+				pread_part(s, buf + r, n, f->offset + off);
+			break;
+		case IO_URING:
+			queue_part(s, buf + r, n, f->offset + off);
+			break;
+		default:
+			read_part(s, buf + r, n, f->offset + off);
+		}
+		r += n;
+		off += n;
+	}
+	submit_parts(s);
+
+	if (s->method != IO_MMAP)
+		add_segment(s, buf, r);
+
+	s->counter += r;
+	*fp = f;
+	*offp = off;
+
+	return r;
+}
+
+/*
+ * move *fp and *offp len bytes ahead without reading anything
+ */
+EXPORT void source_skip(flist_t **fp, off_t *offp, size_t len)
+{
+	flist_t *f = *fp;
+	off_t off = *offp;
+
+	while (f) {
+		off_t left = f->size + f->pad - off;
+
+		if ((off_t) len < left) {
+			off += len;
+			break;
+		}
+
+		len -= left;
+		f = f->next;
+		off = 0;
+	}
+
+	*fp = f;
+	*offp = off;
+}
+
+/*
+ * hash len bytes at base, or len zeros when there is no base,
+ * leaving what we hash alone
+ */
+static void update_segment(SHA_CTX *c, char *base, size_t len)
+{
+#ifdef USE_OPENSSL
+	static const unsigned char zeros[4096];
+
+	if (base) {
+		SHA1_Update(c, base, len);
+		return;
+	}
+	for (; len > sizeof(zeros); len -= sizeof(zeros))
+		SHA1_Update(c, zeros, sizeof(zeros));
+	SHA1_Update(c, zeros, len);
+#else
+	struct iovec iov;
+
+	iov.iov_base = base;
+	iov.iov_len = len;
+	SHA1_UpdateV(c, &iov, 1);
+#endif
+}
+
+/*
+ * hash the segments of the last piece read. the bundled SHA-1 writes to
+ * what it hashes, so mappings go through SHA1_UpdateV(), which doesn't
+ */
+EXPORT void source_update(SHA_CTX *c, source_t *s)
+{
+	struct iovec *iov = s->iov;
+	unsigned int i;
+
+#ifndef USE_OPENSSL
+	if (s->method != IO_MMAP) {
+		for (i = 0; i < s->n; i++, iov++)
+			SHA1_Update(c, iov->iov_base, iov->iov_len);
+		return;
+	}
+#endif
+	for (i = 0; i < s->n; i++, iov++)
+		update_segment(c, iov->iov_base, iov->iov_len);
+}
+
+/*
+ * put the hash of the last piece read in digest, in one go when
+ * it was read into a buffer
+ */
+EXPORT void source_digest(source_t *s, unsigned char *digest)
+{
+	SHA_CTX c;
+
+	if (s->method != IO_MMAP) {
+		SHA1(s->iov[0].iov_base, s->iov[0].iov_len, digest);
+		return;
+	}
+
+	SHA1_Init(&c);
+	source_update(&c, s);
+	SHA1_Final(digest, &c);
+}
+
+/*
+ * let go of the mappings of the last piece read
+ */
+EXPORT void source_release(source_t *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->n; i++)
+		if (s->maps[i].iov_base)
+			munmap(s->maps[i].iov_base, s->maps[i].iov_len);
+	s->n = 0;
+}
+
+EXPORT void source_done(source_t *s)
+{
+	source_release(s);
+	close_source(s);
+	free(s->iov);
+	free(s->maps);
+	free(s->parts);
+	free(s->bounce);
+}
+
+/*
+ * the number of bytes in a piece, which is less than the piece length
+ * for the last one
+ */
+EXPORT size_t piece_size(metafile_t *m, unsigned int piece)
+{
+	int64_t piece_start = (int64_t) piece * m->piece_length;
+
+	if (m->size - piece_start < m->piece_length)
+		return m->size - piece_start;
+
+	return m->piece_length;
+}
+
+/*
+ * make room for the pieces of every other piece length in m->lengths
+ */
+EXPORT void lengths_init(metafile_t *m)
+{
+	plist_t *p;
+
+	for (p = m->lengths; p; p = p->next) {
+		unsigned int pieces = (m->size + p->piece_length - 1)
+			/ p->piece_length;
+
+		/* pieces kept from hashing before stay where they are */
+		p->hash_string = realloc(p->hash_string,
+				(pieces ? pieces : 1) * SHA_DIGEST_LENGTH);
+		if (p->hash_string == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * hash the segments read of a piece, starting pos bytes into it, as
+ * part of the pieces of every other piece length, which are shorter
+ * and so fit a whole number of times. ctx has a context for each of
+ * them, carrying a piece over to the next call when it isn't all
+ * read yet. this has to come before hashing the segments with
+ * SHA1_Update(), which may write to them
+ */
+EXPORT void lengths_update(metafile_t *m, SHA_CTX *ctx, unsigned int piece,
+		size_t pos, const struct iovec *iov, unsigned int n)
+{
+	size_t end = piece_size(m, piece);
+	plist_t *p;
+
+	for (p = m->lengths; p; p = p->next, ctx++) {
+		size_t pl = p->piece_length;
+		unsigned char *dest = p->hash_string + (size_t) piece
+			* (m->piece_length / pl) * SHA_DIGEST_LENGTH;
+		size_t at = pos;
+		unsigned int i;
+
+		for (i = 0; i < n; i++) {
+			char *base = iov[i].iov_base;
+			size_t done = 0;
+
+			while (done < iov[i].iov_len) {
+				size_t len = iov[i].iov_len - done;
+
+				if (at % pl == 0)
+					SHA1_Init(ctx);
+				if (len > pl - at % pl)
+					len = pl - at % pl;
+				update_segment(ctx, base ? base + done : NULL,
+						len);
+				done += len;
+				at += len;
+				if (at % pl == 0 || at == end)
+					SHA1_Final(dest + (at - 1) / pl
+						* SHA_DIGEST_LENGTH, ctx);
+			}
+		}
+	}
+}
+
+/*
+ * check that we hashed as many bytes as the files added up to
+ */
+EXPORT void check_counter(metafile_t *m, int64_t counter)
+{
+#ifndef NO_HASH_CHECK
+	if (counter != m->size) {
+		fprintf(stderr, "Counted %" PRId64 " bytes, "
+				"but hashed %" PRId64 " bytes. "
+				"Something is wrong...\n", m->size, counter);
+		exit(EXIT_FAILURE);
+	}
+#endif
+}
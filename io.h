@@ -0,0 +1,54 @@
+#ifndef _IO_H
+#define _IO_H
+
+struct iovec;
+
+/* room for a SHA_CTX for every piece length -l takes */
+#define MAX_LENGTHS 14
+
+/*
+ * where the pieces come from. a piece is read or mapped with one of
+ * the IO_* methods and handed to the hashing code as a list of
+ * segments, so the hashing code doesn't care how it got there
+ */
+struct source_s;
+typedef struct source_s source_t;
+struct source_s {
+	int method;                /* IO_* */
+	prefetch_t *pf;            /* files opened ahead and read statistics */
+	int print_files;           /* print the name of every file we start on */
+	flist_t *f;                /* file open now */
+	int fd;                    /* ..its file descriptor */
+	int direct;                /* ..whether that bypasses the page cache */
+	off_t pos;                 /* ..the position in it */
+	off_t size;                /* ..and its size when we opened it */
+	struct iovec *iov;         /* segments of the last piece, zeros
+	                              where there is no base */
+	struct iovec *maps;        /* ..and what to unmap after, IO_MMAP */
+	unsigned int n;            /* number of segments */
+	unsigned int alloc;        /* ..and room for them */
+	part_t *parts;             /* reads waiting to be submitted, IO_URING */
+	unsigned int nparts;       /* ..how many */
+	unsigned int parts_alloc;  /* ..and room for them */
+	size_t page;               /* mappings start on a page boundary */
+	unsigned char *bounce;     /* aligned buffer for IO_DIRECT */
+	int64_t counter;           /* bytes of pieces read */
+};
+
+#ifndef ALLINONE
+void source_init(source_t *s, int method, prefetch_t *pf);
+size_t source_read(source_t *s, flist_t **fp, off_t *offp,
+		unsigned char *buf, size_t len);
+void source_skip(flist_t **fp, off_t *offp, size_t len);
+void source_update(SHA_CTX *c, source_t *s);
+void source_digest(source_t *s, unsigned char *digest);
+void source_release(source_t *s);
+void source_done(source_t *s);
+size_t piece_size(metafile_t *m, unsigned int piece);
+void lengths_init(metafile_t *m);
+void lengths_update(metafile_t *m, SHA_CTX *ctx, unsigned int piece,
+		size_t pos, const struct iovec *iov, unsigned int n);
+void check_counter(metafile_t *m, int64_t counter);
+#endif /* ALLINONE */
+
+#endif /* _IO_H */
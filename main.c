@@ -24,23 +24,42 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include <stdio.h>       /* printf() etc. */
 #include <sys/stat.h>    /* S_IRUSR, S_IWUSR, S_IRGRP, S_IROTH */
 #include <fcntl.h>       /* open() */
+#include <unistd.h>      /* access(), write(), close(), link(), fsync(),
+                            readlink() */
 
 #ifdef ALLINONE
 #include <sys/stat.h>
-#include <unistd.h>      /* access(), read(), close(), getcwd(), sysconf() */
 #include <strings.h>     /* strcasecmp() */
 #include <inttypes.h>    /* PRId64 etc. */
 #include <ctype.h>       /* isdigit */
+#include <stdarg.h>      /* va_list etc. */
+#include <sys/time.h>    /* gettimeofday() */
 #ifdef USE_LONG_OPTIONS
 #include <getopt.h>      /* getopt_long() */
 #endif
 #include <time.h>        /* time() */
 #include <dirent.h>      /* opendir(), closedir(), readdir() etc. */
+#include <sys/uio.h>     /* struct iovec */
+#include <sys/mman.h>    /* mmap(), munmap() */
+#ifdef __linux__
+#include <sys/syscall.h> /* syscall(), SYS_* and __NR_* */
+#include <linux/perf_event.h> /* struct perf_event_attr */
+#endif
+#ifdef USE_IO_URING
+#include <linux/io_uring.h> /* io_uring structures and constants */
+#endif
 #ifdef USE_OPENSSL
 #include <openssl/sha.h> /* SHA1(), SHA_DIGEST_LENGTH */
 #endif
 #ifdef USE_PTHREADS
 #include <pthread.h>     /* pthread functions and data structures */
+#include <limits.h>      /* INT_MAX */
+#ifdef __linux__
+#include <sys/ioctl.h>   /* ioctl() */
+#include <linux/fs.h>    /* FIBMAP, FIGETBSZ, FS_IOC_FIEMAP */
+#include <linux/fiemap.h> /* struct fiemap */
+#include <linux/perf_event.h> /* struct perf_event_attr */
+#endif
 #endif
 
 #define EXPORT static
@@ -53,12 +72,20 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
 #ifdef ALLINONE
 #include "ftw.c"
-#include "init.c"
+#include "tar.c"
+#include "filter.c"
 
 #ifndef USE_OPENSSL
 #include "sha1.c"
 #endif
 
+#include "bencode.c"
+#include "edit.c"
+#include "init.c"
+#include "prefetch.c"
+#include "reuse.c"
+#include "io.c"
+
 #ifdef USE_PTHREADS
 #include "hash_pthreads.c"
 #else
@@ -66,13 +93,26 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #endif
 
 #include "output.c"
+#include "estimate.c"
+#include "bench.c"
 #else /* ALLINONE */
 /* init.c */
 extern void init(metafile_t *m, int argc, char *argv[]);
+extern unsigned int check_files(metafile_t *m, unsigned char *hash_string);
+/* prefetch.c */
+extern const char *prefetch_strerror(int err);
 /* hash.c */
 extern unsigned char *make_hash(metafile_t *m);
+/* edit.c */
+extern void check_infohash(metafile_t *m);
 /* output.c */
-extern void write_metainfo(FILE *f, metafile_t *m, unsigned char *hash_string);
+extern size_t write_metainfo(char **out, metafile_t *m,
+		unsigned char *hash_string);
+extern void print_magnet(metafile_t *m);
+/* estimate.c */
+extern void estimate(metafile_t *m);
+/* bench.c */
+extern void bench(metafile_t *m);
 #endif /* ALLINONE */
 
 #ifndef O_BINARY
@@ -86,55 +126,350 @@ extern void write_metainfo(FILE *f, metafile_t *m, unsigned char *hash_string);
 #define S_IROTH 0
 #endif
 
+/* times to hash files that keep changing before giving up */
+#ifndef HASH_PASSES
+#define HASH_PASSES 5
+#endif
+
+/* symbolic links to follow to the metainfo file before giving up */
+#ifndef MAX_LINKS
+#define MAX_LINKS 40
+#endif
+
+static slist_t *temp_paths;	/* files to remove if we don't make it */
+
+/*
+ * hash the files, and hash again what changed while we hashed it, and
+ * with -k what moved when leaving out the files we couldn't read
+ */
+static unsigned char *hash_files(metafile_t *m)
+{
+	unsigned char *hash_string = make_hash(m);
+	unsigned int passes = 1;
+
+	while (check_files(m, hash_string)) {
+		if (++passes > HASH_PASSES) {
+			fprintf(stderr, "The files kept changing "
+					"while we hashed them.\n");
+			exit(EXIT_FAILURE);
+		}
+		printf("Hashing again what changed.\n");
+		hash_string = make_hash(m);
+	}
+
+	return hash_string;
+}
+
+/*
+ * list the files we left out with -k, and why
+ */
+static void report_dropped(metafile_t *m)
+{
+	flist_t *f;
+	unsigned int n = 0;
+
+	for (f = m->dropped; f; f = f->next)
+		n++;
+	if (n == 0)
+		return;
+
+	fflush(stdout);
+	fprintf(stderr, "Left out %u file%s we couldn't read:\n",
+			n, n == 1 ? "" : "s");
+	for (f = m->dropped; f; f = f->next)
+		fprintf(stderr, "  %s: %s\n", f->path, prefetch_strerror(f->error));
+}
+
+static void remove_temp(void)
+{
+	slist_t *t;
+
+	for (t = temp_paths; t; t = t->next)
+		if (t->s)
+			unlink(t->s);
+}
+
+/*
+ * read where the symbolic link at path points to
+ */
+static char *read_link(const char *path, size_t size)
+{
+	char *target = NULL;
+	ssize_t n;
+
+	do {
+		/* the link may have grown since we looked at its size */
+		size = size ? 2*size : 256;
+		free(target);
+		target = malloc(size);
+		if (target == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		n = readlink(path, target, size);
+		if (n < 0) {
+			fprintf(stderr, PROGRAM ": Error reading link '%s': %s\n",
+				path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	} while ((size_t) n >= size);
+	target[n] = '\0';
+
+	return target;
+}
+
 /*
- * create and open the metainfo file for writing and create a stream for it
- * we don't want to overwrite anything, so abort if the file is already there
- * unless the --force option was specified
+ * follow the absolute path while it is a symbolic link, so overwriting
+ * it replaces the file it points to, like writing through it did,
+ * instead of the link. returns path itself when it isn't a link
  */
-static FILE *open_file(const char *path, const int overwrite)
+static char *follow_links(char *path)
 {
+	char *p = path;
+	struct stat st;
+	unsigned int hops = 0;
+
+	while (lstat(p, &st) == 0 && S_ISLNK(st.st_mode)) {
+		char *target;
+		char *next;
+
+		if (++hops > MAX_LINKS) {
+			fprintf(stderr, PROGRAM ": Error opening '%s': %s\n",
+				path, strerror(ELOOP));
+			exit(EXIT_FAILURE);
+		}
+
+		target = read_link(p, st.st_size);
+
+		if (target[0] == DIRSEP[0])
+			next = target;
+		else {
+			/* a relative link is relative to where it is */
+			size_t dir = strrchr(p, DIRSEP[0]) - p + 1;
+
+			next = malloc(dir + strlen(target) + 1);
+			if (next == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				exit(EXIT_FAILURE);
+			}
+			memcpy(next, p, dir);
+			strcpy(next + dir, target);
+			free(target);
+		}
+
+		if (p != path)
+			free(p);
+		p = next;
+	}
+
+	return p;
+}
+
+/*
+ * create a temporary file next to the metainfo file for writing, so the
+ * metainfo file never appears half written. we don't want to overwrite
+ * anything, so abort if the file is already there unless the --force
+ * option was specified. that is checked again when we put it in place.
+ * something that isn't a regular file, like a pipe or /dev/stdout, is
+ * written to directly instead of being replaced, and so is the file a
+ * symbolic link points to, which *path is set to. *tp is set to
+ * where we keep the name of the temporary file, if there is one
+ */
+static int open_file(char **path_p, const int overwrite, slist_t **tp)
+{
+	char *path;		/* the metainfo file */
 	int fd;			/* file descriptor */
-	int fdflags;		/* flags for opening fd */
-	mode_t fdmode;		/* mode for opening fd */
-	FILE *f;		/* file stream */
+	char *temp;		/* name of the temporary file */
+	mode_t mask;		/* the umask */
+	struct stat st;
+	slist_t *t;
+
+	/* remember it, so it is removed if we don't make it */
+	t = malloc(sizeof(slist_t));
+	if (t == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	t->s = NULL;
+	t->next = temp_paths;
+	temp_paths = *tp = t;
 
-	/* open and create the file if it doesn't exist already
-	   truncate it if it does and the force option was used */
 	if (overwrite)
-		fdflags = O_WRONLY | O_BINARY | O_CREAT | O_TRUNC;
-	else
-		fdflags = O_WRONLY | O_BINARY | O_CREAT | O_EXCL;
-	fdmode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-	fd = open(path, fdflags, fdmode);
+		*path_p = follow_links(*path_p);
+	path = *path_p;
+
+	if (!overwrite && lstat(path, &st) == 0) {
+		fprintf(stderr, PROGRAM ": Error creating '%s': %s\n",
+			path, strerror(EEXIST));
+		exit(EXIT_FAILURE);
+	}
+
+	if (overwrite && stat(path, &st) == 0 && !S_ISREG(st.st_mode)) {
+		fd = open(path, O_WRONLY | O_BINARY);
+		if (fd < 0) {
+			fprintf(stderr, PROGRAM ": Error opening '%s': %s\n",
+				path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		return fd;
+	}
+
+	temp = malloc(strlen(path) + 8);
+	if (temp == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(temp, "%s.XXXXXX", path);
+
+	fd = mkstemp(temp);
 	if (fd < 0) {
 		fprintf(stderr, PROGRAM ": Error creating '%s': %s\n",
 			path, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
+	t->s = temp;
 
-	/* create the stream from this filedescriptor */
-	f = fdopen(fd, "wb");
-	if (f == NULL) {
-		fprintf(stderr,
-			PROGRAM ": Error creating stream for '%s': %s\n",
-			path, strerror(errno));
+	/* mkstemp() only lets us read the file,
+	   so give it the usual permissions */
+	mask = umask(0);
+	umask(mask);
+	if (fchmod(fd, (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) & ~mask)) {
+		fprintf(stderr, PROGRAM ": Error changing mode of '%s': %s\n",
+			temp, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	return f;
+	return fd;
+}
+
+static int sync_fd(int fd)
+{
+#if defined _POSIX_SYNCHRONIZED_IO && _POSIX_SYNCHRONIZED_IO > 0
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
 }
 
 /*
- * close the metainfo file
+ * sync the directory holding path, so a file renamed into it stays
  */
-static void close_file(FILE *f)
+static void sync_dir(const char *path)
 {
-	/* close the metainfo file */
-	if (fclose(f)) {
-		fprintf(stderr, "Error closing stream: %s\n",
-				strerror(errno));
+	char *dir = strdup(path);
+	char *end;
+	int fd;
+
+	if (dir == NULL) {
+		fprintf(stderr, "Out of memory.\n");
 		exit(EXIT_FAILURE);
 	}
+
+	end = strrchr(dir, DIRSEP[0]);
+	if (end == NULL)
+		strcpy(dir, ".");
+	else if (end == dir)
+		end[1] = '\0';
+	else
+		*end = '\0';
+
+	fd = open(dir, O_RDONLY);
+	if (fd < 0 || fsync(fd)) {
+		fprintf(stderr, PROGRAM ": Error syncing '%s': %s\n",
+			dir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	free(dir);
+}
+
+/*
+ * write the metainfo to the temporary file in one go, close it
+ * and put it in place as the metainfo file, or just write it when
+ * there is no temporary file
+ */
+static void close_file(int fd, const char *path, slist_t *temp,
+		const char *buf, size_t len, const int overwrite,
+		const int sync)
+{
+	char *temp_path = temp->s;
+	const char *name = temp_path ? temp_path : path;
+	ssize_t n;
+	int err;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			fprintf(stderr, PROGRAM ": Error writing '%s': %s\n",
+				name, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		buf += n;
+		len -= n;
+	}
+
+	/* there's no disk behind pipes and devices to sync */
+	if (sync && temp_path && sync_fd(fd)) {
+		fprintf(stderr, PROGRAM ": Error syncing '%s': %s\n",
+			name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (close(fd)) {
+		fprintf(stderr, PROGRAM ": Error closing '%s': %s\n",
+			name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (temp_path == NULL)
+		return;
+
+	/* rename() replaces the file if it is there, while link() fails
+	   like open(O_EXCL) would if someone created it in the meantime */
+	if (overwrite)
+		err = rename(temp_path, path);
+	else if ((err = link(temp_path, path)) == 0)
+		unlink(temp_path);
+	else if (errno != EEXIST) {
+		/* the file system can't do hard links, so
+		   rename unless the file is there by now */
+		if (access(path, F_OK) == 0)
+			errno = EEXIST;
+		else
+			err = rename(temp_path, path);
+	}
+	if (err) {
+		fprintf(stderr, PROGRAM ": Error creating '%s': %s\n",
+			path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	temp->s = NULL;
+	free(temp_path);
+
+	if (sync)
+		sync_dir(path);
+}
+
+/*
+ * encode the metainfo and write it to the metainfo file at path,
+ * open as fd
+ */
+static void write_file(metafile_t *m, int fd, const char *path,
+		slist_t *temp, unsigned char *hash_string)
+{
+	char *buf;	/* the metainfo */
+	size_t len;	/* ..and its length */
+
+	len = write_metainfo(&buf, m, hash_string);
+
+	/* let the user know we're writing the metainfo file */
+	printf("Writing metainfo file... ");
+	fflush(stdout);
+	close_file(fd, path, temp, buf, len, m->force, m->sync);
+	printf("done.\n");
+	free(buf);
 }
 
 /*
@@ -142,7 +477,9 @@ static void close_file(FILE *f)
  */
 int main(int argc, char *argv[])
 {
-	FILE *file;	/* stream for writing to the metainfo file */
+	int fd;		/* temporary file for the metainfo */
+	slist_t *temp;	/* ..and its name */
+	plist_t *l;	/* other piece lengths */
 	metafile_t m = {
 		/* options */
 		0,    /* piece_length */
@@ -157,14 +494,41 @@ int main(int argc, char *argv[])
 		0,    /* private */
 		0,    /* verbose */
 		0,    /* force */
+		READAHEAD, /* readahead */
+		0,    /* edit */
+		0,    /* magnet */
+		0,    /* dry_run */
+		0,    /* sync */
+		0,    /* reproducible */
+		NULL, /* hash_cache */
+		0,    /* pad */
+		0,    /* bench */
+		IO_READ, /* io */
+		0,    /* keep_going */
+		NULL, /* tar */
+		NULL, /* lengths */
+		NULL, /* include */
+		NULL, /* exclude */
 #ifdef USE_PTHREADS
 		0,    /* threads, initialised by init() */
+		0,    /* block_order */
+		0,    /* adaptive_threads */
+		0,    /* cache_resident */
 #endif
 
 		/* information calculated by read_dir() */
 		0,    /* size */
 		NULL, /* file_list */
-		0     /* pieces */
+		0,    /* pieces */
+		NULL, /* dropped */
+		NULL, /* kept */
+
+		/* calculated by write_metainfo() */
+		{0},  /* infohash */
+
+		/* information read from the metainfo file by read_metainfo() */
+		NULL, /* hash_string */
+		{0}   /* old_infohash */
 	};
 
 	/* print who we are */
@@ -174,15 +538,48 @@ int main(int argc, char *argv[])
 	/* process options */
 	init(&m, argc, argv);
 
-	/* open the file stream now, so we don't have to abort
+	if (m.bench) {
+		bench(&m);
+		return EXIT_SUCCESS;
+	}
+
+	/* tell what we would do and stop there */
+	if (m.dry_run) {
+		estimate(&m);
+		return EXIT_SUCCESS;
+	}
+
+	/* create the file now, so we don't have to abort
 	   _after_ we did all the hashing in case we fail */
-	file = open_file(m.metainfo_file_path, m.force);
+	atexit(remove_temp);
+	fd = open_file(&m.metainfo_file_path, m.force, &temp);
+	for (l = m.lengths; l; l = l->next)
+		l->fd = open_file(&l->metainfo_file_path, m.force,
+				&l->temp);
+
+	/* calculate hash string, unless we're editing a metainfo
+	   file that has it already, and write the metainfo */
+	write_file(&m, fd, m.metainfo_file_path, temp,
+			m.edit ? m.hash_string : hash_files(&m));
 
-	/* calculate hash string and write the metainfo to file */
-	write_metainfo(file, &m, make_hash(&m));
+	if (m.edit)
+		check_infohash(&m);
+
+	if (m.magnet)
+		print_magnet(&m);
+
+	/* the pieces of the other piece lengths were
+	   hashed along with the ones we hashed */
+	for (l = m.lengths; l; l = l->next) {
+		m.piece_length = l->piece_length;
+		m.pieces = (m.size + l->piece_length - 1) / l->piece_length;
+		write_file(&m, l->fd, l->metainfo_file_path, l->temp,
+				l->hash_string);
+		if (m.magnet)
+			print_magnet(&m);
+	}
 
-	/* close the file stream */
-	close_file(file);
+	report_dropped(&m);
 
 	/* yeih! everything seemed to go as planned */
 	return EXIT_SUCCESS;
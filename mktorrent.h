@@ -10,6 +10,9 @@
 /* name of the program */
 #define PROGRAM		"mktorrent"
 
+/* default number of files to open and read ahead */
+#define READAHEAD	8
+
 /* number of bytes in one MB */
 #define ONEMEG		1048576
 
@@ -41,21 +44,80 @@ struct llist_s {
 	llist_t *next;
 };
 
+/* the nanoseconds of the times in a stat structure, where it has them.
+   st_mtime is st_mtim.tv_sec where there is st_mtim */
+#if defined __APPLE__
+#define ST_MTIME_NSEC(st) ((long) (st)->st_mtimespec.tv_nsec)
+#define ST_CTIME_NSEC(st) ((long) (st)->st_ctimespec.tv_nsec)
+#elif defined st_mtime
+#define ST_MTIME_NSEC(st) ((long) (st)->st_mtim.tv_nsec)
+#define ST_CTIME_NSEC(st) ((long) (st)->st_ctim.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st) 0L
+#define ST_CTIME_NSEC(st) 0L
+#endif
+
 /* file list */
 struct flist_s;
 typedef struct flist_s flist_t;
 struct flist_s {
 	char *path;
 	off_t size;
+	off_t pad;         /* zeros following the file (BEP 47) */
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	time_t ctime;
+	long mtime_nsec;   /* ..and the nanoseconds of them, so a change
+	                      in the second we looked at it is seen too */
+	long ctime_nsec;
+	int sparse;        /* has fewer blocks than bytes, so maybe holes */
+	off_t offset;      /* where it starts in the tar file, -T */
+	int error;         /* errno of why we couldn't read it with -k,
+	                      SHRANK if it shrank, 0 if we could */
+	int changed;       /* isn't what it was when we scanned it */
 	flist_t *next;
 };
 
+/* piece length list */
+struct plist_s;
+typedef struct plist_s plist_t;
+struct plist_s {
+	unsigned int piece_length;
+	char *metainfo_file_path;  /* the metainfo file made with it */
+	unsigned char *hash_string; /* ..and its pieces */
+	int fd;                    /* ..open for writing it */
+	slist_t *temp;             /* ..to the temporary file in here */
+	plist_t *next;
+};
+
+/* pattern list, of -i and -x */
+struct pattern_s;
+typedef struct pattern_s pattern_t;
+struct pattern_s {
+	const char *glob;  /* the shell pattern */
+	int kind;          /* how to match it, PATTERN_* in filter.c */
+	const char *text;  /* ..the part of it matched as it is */
+	size_t len;        /* ..and its length */
+	int path;          /* matched against the path from the top
+	                      instead of the name */
+	pattern_t *next;
+};
+
+/* ways of getting at the contents of the files */
+#define IO_READ   0        /* read() them into buffers */
+#define IO_MMAP   1        /* hash them where they are mapped */
+#define IO_PREAD  2        /* pread() them into buffers */
+#define IO_DIRECT 3        /* ..bypassing the page cache */
+#define IO_URING  4        /* queue all the reads of a piece at once */
+
 /* extra fields list */
 struct elist_s;
 typedef struct elist_s elist_t;
 struct elist_s {
 	char *key;
 	char *value;
+	size_t raw_len;    /* value is this many bytes of bencoding */
 	elist_t *next;
 };
 
@@ -73,14 +135,45 @@ typedef struct {
 	int private;               /* set the private flag */
 	int verbose;               /* be verbose */
 	int force;                 /* overwrite metainfo file */
+	unsigned int readahead;    /* number of files to open and read ahead */
+	int edit;                  /* edit the metainfo file given as target */
+	int magnet;                /* print the infohash and a magnet link */
+	int dry_run;               /* only estimate what we would do */
+	int sync;                  /* sync the metainfo file to disk */
+	int reproducible;          /* same contents, same metainfo file */
+	char *hash_cache;          /* file to keep the hashes of files in */
+	int pad;                   /* align files to piece boundaries */
+	int bench;                 /* only benchmark hashing */
+	int io;                    /* how to get at the contents, IO_* */
+	int keep_going;            /* leave out files we can't read */
+	const char *tar;           /* tar file the files are members of */
+	plist_t *lengths;          /* shorter piece lengths to make
+	                              metainfo files with too */
+	pattern_t *include;        /* files to put in the torrent, all
+	                              if NULL */
+	pattern_t *exclude;        /* files and directories to leave out */
 #ifdef USE_PTHREADS
 	long threads;              /* number of threads used for hashing */
+	int block_order;           /* read pieces in the order they are on disk */
+	int adaptive_threads;      /* vary the number of threads hashing */
+	int cache_resident;        /* hash pieces as they are read */
 #endif
 
 	/* information calculated by read_dir() */
 	int64_t size;              /* combined size of all files */
 	flist_t *file_list;        /* list of files and their sizes */
 	unsigned int pieces;       /* number of pieces */
+	flist_t *dropped;          /* files left out as we couldn't read them */
+	unsigned char *kept;       /* for every piece whether hash_string
+	                              has it right from hashing it before,
+	                              NULL if none */
+
+	/* calculated by write_metainfo() */
+	unsigned char infohash[20]; /* SHA1 of the info section */
+
+	/* information read from the metainfo file by read_metainfo() */
+	unsigned char *hash_string; /* the pieces, which we don't rehash */
+	unsigned char old_infohash[20]; /* the infohash of the file */
 } metafile_t;
 
 #endif /* _MKTORRENT_H */
@@ -22,12 +22,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #include <string.h>       /* strlen() etc. */
 #include <time.h>         /* time() */
 #include <stdlib.h>       /* exit() */
+#include <stdarg.h>       /* va_list etc. */
 #include <ctype.h>        /* isdigit() */
+#include <inttypes.h>     /* PRId64 etc. */
 
 #ifdef USE_OPENSSL
-#include <openssl/sha.h>  /* SHA_DIGEST_LENGTH */
+#include <openssl/sha.h>  /* SHA_DIGEST_LENGTH, SHA1_Update() etc. */
 #else
-#include <inttypes.h>
 #include "sha1.h"
 #endif
 
@@ -36,80 +37,165 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 #define EXPORT
 #endif /* ALLINONE */
 
+/*
+ * everything is written through a sink, which collects the metainfo
+ * in memory so it can be written to the file in one go, and hashes
+ * the info section on its way there so we get the infohash for free.
+ * a sink that doesn't collect only counts the bytes
+ */
+struct sink_s;
+typedef struct sink_s sink_t;
+struct sink_s {
+	char *buf;       /* the metainfo so far */
+	size_t size;     /* bytes written so far */
+	size_t alloc;    /* room in buf */
+	int collect;     /* keep what is written in buf */
+	int hashing;     /* we're in the info section */
+	SHA_CTX c;
+};
+
+static void put(sink_t *s, const void *p, size_t len)
+{
+	if (!s->collect) {
+		s->size += len;
+		return;
+	}
+
+	if (s->size + len > s->alloc) {
+		while (s->size + len > s->alloc)
+			s->alloc = s->alloc ? 2 * s->alloc : 4096;
+		s->buf = realloc(s->buf, s->alloc);
+		if (s->buf == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memcpy(s->buf + s->size, p, len);
+	s->size += len;
+
+	/* our own SHA1_Update() scribbles on the data it hashes,
+	   so it only gets to see a copy */
+	while (s->hashing && len) {
+		unsigned char scratch[4096];
+		size_t n = len < sizeof(scratch) ? len : sizeof(scratch);
+
+		memcpy(scratch, p, n);
+		SHA1_Update(&s->c, scratch, n);
+		p = (const char *) p + n;
+		len -= n;
+	}
+}
+
+/*
+ * write a formatted string that fits in 64 bytes, so it's only for
+ * keys, numbers and the like
+ */
+static void putf(sink_t *s, const char *format, ...)
+{
+	char buf[64];
+	va_list ap;
+	int n;
+
+	va_start(ap, format);
+	n = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	put(s, buf, n);
+}
+
+/*
+ * write the first len bytes of str as a bencoded string
+ */
+static void put_string_n(sink_t *s, const char *str, size_t len)
+{
+	putf(s, "%lu:", (unsigned long) len);
+	put(s, str, len);
+}
+
+static void put_string(sink_t *s, const char *str)
+{
+	put_string_n(s, str, strlen(str));
+}
+
 /*
  * write announce list
  */
-static void write_announce_list(FILE *f, llist_t *list)
+static void write_announce_list(sink_t *s, llist_t *list)
 {
 	/* the announce list is a list of lists of urls */
-	fprintf(f, "13:announce-listl");
+	put(s, "13:announce-listl", 17);
 	/* go through them all.. */
 	for (; list; list = list->next) {
 		slist_t *l;
 
 		/* .. and print the lists */
-		fprintf(f, "l");
+		put(s, "l", 1);
 		for (l = list->l; l; l = l->next)
-			fprintf(f, "%lu:%s",
-					(unsigned long)strlen(l->s), l->s);
-		fprintf(f, "e");
+			put_string(s, l->s);
+		put(s, "e", 1);
 	}
-	fprintf(f, "e");
+	put(s, "e", 1);
 }
 
 /*
  * write file list
  */
-static void write_file_list(FILE *f, flist_t *list)
+static void write_file_list(sink_t *s, flist_t *list)
 {
 	char *a, *b;
 
-	fprintf(f, "5:filesl");
+	put(s, "5:filesl", 8);
 
 	/* go through all the files */
 	for (; list; list = list->next) {
 		/* the file list contains a dictionary for every file
 		   with entries for the length and path
 		   write the length first */
-		fprintf(f, "d6:lengthi%" PRIoff "e4:pathl", list->size);
+		putf(s, "d6:lengthi%" PRIoff "e4:pathl", list->size);
 		/* the file path is written as a list of subdirectories
-		   and the last entry is the filename
-		   sorry this code is even uglier than the rest */
+		   and the last entry is the filename */
 		a = list->path;
 		/* while there are subdirectories before the filename.. */
 		while ((b = strchr(a, DIRSEP[0])) != NULL) {
-			/* set the next DIRSEP[0] to '\0' so fprintf
-			   will only write the first subdirectory name */
-			*b = '\0';
 			/* print it bencoded */
-			fprintf(f, "%lu:%s", (unsigned long)strlen(a), a);
-			/* undo our alteration to the string */
-			*b = DIRSEP[0];
+			put_string_n(s, a, b - a);
 			/* and move a to the beginning of the next
 			   subdir or filename */
 			a = b + 1;
 		}
 		/* now print the filename bencoded and end the
 		   path name list and file dictionary */
-		fprintf(f, "%lu:%see", (unsigned long)strlen(a), a);
+		put_string(s, a);
+		put(s, "ee", 2);
+
+		/* BEP 47 padding file of zeros up to the next piece */
+		if (list->pad) {
+			char n[24];
+
+			sprintf(n, "%" PRIoff, list->pad);
+			putf(s, "d4:attr1:p6:lengthi%se", n);
+			putf(s, "4:pathl4:.pad%lu:%see",
+					(unsigned long) strlen(n), n);
+		}
 	}
 
 	/* whew, now end the file list */
-	fprintf(f, "e");
+	put(s, "e", 1);
 }
 
 /*
  * write web seed list
  */
-static void write_web_seed_list(FILE *f, slist_t *list)
+static void write_web_seed_list(sink_t *s, slist_t *list)
 {
 	/* print the entry and start the list */
-	fprintf(f, "8:url-listl");
+	put(s, "8:url-listl", 11);
 	/* go through the list and write each URL */
 	for (; list; list = list->next)
-		fprintf(f, "%lu:%s", (unsigned long)strlen(list->s), list->s);
+		put_string(s, list->s);
 	/* end the list */
-	fprintf(f, "e");
+	put(s, "e", 1);
 }
 
 /*
@@ -185,134 +271,190 @@ int is_bencode_int(char *s)
  * the list not written. if the reference key is NULL, write all the
  * remaining nodes in the list.
  */
-static elist_t *write_extra(FILE *f, elist_t *list, char *refkey)
+static elist_t *write_extra(sink_t *s, elist_t *list, char *refkey)
 {
 	while ((list != NULL) &&
 	       (refkey == NULL || strcmp(list->key, refkey) < 0)) {
 		/* if the key and value strings are not null, print the key
 		 * as a bencoded string. */
 		if (list->key && list->value)
-			fprintf(f, "%d:%s", (int) strlen(list->key),
-				list->key);
+			put_string(s, list->key);
 		else {
 			/* something is very broken if this happens */
 			fprintf(stderr, PROGRAM
 				": internal failure code extra\n");
 			exit(EXIT_FAILURE);
 		}
-		/* if it is a bencode integer, write it. else write it as a
-		 * bencoded string. */
-		if (is_bencode_int(list->value))
-			fprintf(f, "%s", list->value);
+		/* if it is a bencode integer or was copied from a
+		 * metainfo file, write it. else write it as a bencoded
+		 * string. */
+		if (list->raw_len)
+			put(s, list->value, list->raw_len);
+		else if (is_bencode_int(list->value))
+			put(s, list->value, strlen(list->value));
 		else
-			fprintf(f, "%d:%s", (int) strlen(list->value),
-				list->value);
+			put_string(s, list->value);
 		list = list->next;
 	}
 	return list;
 }
 
 /*
- * write metainfo to the file stream using all the information
- * we've gathered so far and the hash string calculated
+ * encode the metainfo using all the information we've gathered so far
+ * and the hash string calculated into a buffer returned in *out, and
+ * fill out the infohash. returns the length of the metainfo, which is
+ * all we work out when out is NULL
  */
-EXPORT void write_metainfo(FILE *f, metafile_t *m, unsigned char *hash_string)
+EXPORT size_t write_metainfo(char **out, metafile_t *m,
+		unsigned char *hash_string)
 {
 	elist_t *extra_list = m->extra;
+	sink_t sink;
+	sink_t *s = &sink;
 
-	/* let the user know we've started writing the metainfo file */
-	printf("Writing metainfo file... ");
-	fflush(stdout);
+	sink.buf = NULL;
+	sink.size = 0;
+	sink.alloc = 0;
+	sink.collect = out != NULL;
+	sink.hashing = 0;
 
 	/* every metainfo file is one big dictonary */
-	fprintf(f, "d");
+	put(s, "d", 1);
 
 	if (m->announce_list != NULL) {
 		/* write the announce URL */
-		fprintf(f, "8:announce%lu:%s",
-			(unsigned long)strlen(m->announce_list->l->s),
-			m->announce_list->l->s);
+		put(s, "8:announce", 10);
+		put_string(s, m->announce_list->l->s);
 		/* write the announce-list entry if we have
 		   more than one announce URL */
 		if (m->announce_list->next || m->announce_list->l->next)
-			write_announce_list(f, m->announce_list);
+			write_announce_list(s, m->announce_list);
 	}
 
 	/* add the comment if one is specified */
-	if (m->comment != NULL)
-		fprintf(f, "7:comment%lu:%s",
-				(unsigned long)strlen(m->comment),
-				m->comment);
-	/* I made this! */
-	fprintf(f, "10:created by%lu:%s %s",
-		(unsigned long) strlen(VERSION) + strlen(PROGRAM) + 1,
-		PROGRAM, VERSION);
+	if (m->comment != NULL) {
+		put(s, "7:comment", 9);
+		put_string(s, m->comment);
+	}
+	/* I made this! leave out the version when the file should
+	   be the same whichever version made it */
+	put(s, "10:created by", 13);
+	put_string(s, m->reproducible ? PROGRAM : PROGRAM " " VERSION);
 	/* add the creation date */
 	if (!m->no_creation_date)
-		fprintf(f, "13:creation datei%lde",
-			(long)time(NULL));
+		putf(s, "13:creation datei%lde", (long)time(NULL));
 
 	/* now here comes the info section; it is yet another dictionary.
 	   the entries in a dictionary must be written in order sorted by
 	   the keys. Before writing each key, there is an attempt to write
 	   any user defined extra entries which might need to be written
 	   first. */
-	fprintf(f, "4:infod");
+	put(s, "4:info", 6);
+	SHA1_Init(&sink.c);
+	sink.hashing = 1;
+	put(s, "d", 1);
 	/* first entry is either 'files', which specifies a list of files
 	   and their respective sizes for a directory torrent, or 'length',
 	   which specifies the length of a single file torrent */
 	if (m->target_is_directory) {
 		if (extra_list)
-			extra_list = write_extra(f, extra_list, "files");
-		write_file_list(f, m->file_list);
+			extra_list = write_extra(s, extra_list, "files");
+		write_file_list(s, m->file_list);
 	} else {
 		if (extra_list)
-			extra_list = write_extra(f, extra_list, "length");
-		fprintf(f, "6:lengthi%" PRIoff "e", m->file_list->size);
+			extra_list = write_extra(s, extra_list, "length");
+		putf(s, "6:lengthi%" PRIoff "e", m->file_list->size);
 	}
 
 	/* the info section also contains the name of the torrent,
 	   the piece length and the hash string */
 	if (extra_list)
-		extra_list = write_extra(f, extra_list, "name");
-	fprintf(f, "4:name%lu:%s",
-		(unsigned long) strlen(m->torrent_name), m->torrent_name);
+		extra_list = write_extra(s, extra_list, "name");
+	put(s, "4:name", 6);
+	put_string(s, m->torrent_name);
 	if (extra_list)
-		extra_list = write_extra(f, extra_list, "piece length");
-	fprintf(f, "12:piece lengthi%ue", m->piece_length);
+		extra_list = write_extra(s, extra_list, "piece length");
+	putf(s, "12:piece lengthi%ue", m->piece_length);
 	if (extra_list)
-		extra_list = write_extra(f, extra_list, "pieces");
-	fprintf(f, "6:pieces%u:", m->pieces * SHA_DIGEST_LENGTH);
-	fwrite(hash_string, 1, m->pieces * SHA_DIGEST_LENGTH, f);
+		extra_list = write_extra(s, extra_list, "pieces");
+	putf(s, "6:pieces%u:", m->pieces * SHA_DIGEST_LENGTH);
+	put(s, hash_string, m->pieces * SHA_DIGEST_LENGTH);
 
 	/* set the private flag */
 	if (m->private) {
 		if (extra_list)
-			extra_list = write_extra(f, extra_list, "private");
-		fprintf(f, "7:privatei1e");
+			extra_list = write_extra(s, extra_list, "private");
+		put(s, "7:privatei1e", 12);
 	}
 
 	/* add any remaining extra fields. */
 	if (extra_list)
-		extra_list = write_extra(f, extra_list, NULL);
+		extra_list = write_extra(s, extra_list, NULL);
 
 	/* end the info section */
-	fprintf(f, "e");
+	put(s, "e", 1);
+	sink.hashing = 0;
+	SHA1_Final(m->infohash, &sink.c);
 
 	/* add url-list if one is specified */
 	if (m->web_seed_list != NULL) {
-		if (m->web_seed_list->next == NULL)
-			fprintf(f, "8:url-list%lu:%s",
-					(unsigned long)strlen(m->web_seed_list->s),
-					m->web_seed_list->s);
-		else
-			write_web_seed_list(f, m->web_seed_list);
+		if (m->web_seed_list->next == NULL) {
+			put(s, "8:url-list", 10);
+			put_string(s, m->web_seed_list->s);
+		} else
+			write_web_seed_list(s, m->web_seed_list);
 	}
 
 	/* end the root dictionary */
-	fprintf(f, "e");
+	put(s, "e", 1);
+
+	if (out)
+		*out = sink.buf;
+	return sink.size;
+}
 
-	/* let the user know we're done already */
-	printf("done.\n");
-	fflush(stdout);
+/*
+ * print a string with everything but unreserved characters
+ * percent encoded, as it should be in a URI query
+ */
+static void print_uri_encoded(const char *str)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *) str; *p; p++)
+		if (isalnum(*p) || strchr("-._~", *p))
+			putchar(*p);
+		else
+			printf("%%%02X", *p);
+}
+
+/*
+ * print the infohash written by write_metainfo()
+ * and a magnet link with the name, trackers and web seeds
+ */
+EXPORT void print_magnet(metafile_t *m)
+{
+	llist_t *tier;
+	slist_t *l;
+	int i;
+
+	printf("Info hash: ");
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+		printf("%02x", m->infohash[i]);
+
+	printf("\nMagnet link: magnet:?xt=urn:btih:");
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+		printf("%02x", m->infohash[i]);
+	printf("&dn=");
+	print_uri_encoded(m->torrent_name);
+	for (tier = m->announce_list; tier; tier = tier->next)
+		for (l = tier->l; l; l = l->next) {
+			printf("&tr=");
+			print_uri_encoded(l->s);
+		}
+	for (l = m->web_seed_list; l; l = l->next) {
+		printf("&ws=");
+		print_uri_encoded(l->s);
+	}
+	printf("\n");
 }
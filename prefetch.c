@@ -0,0 +1,915 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef ALLINONE
+#include <stdlib.h>       /* exit(), malloc() */
+#include <sys/types.h>    /* off_t */
+#include <sys/stat.h>     /* fstat() */
+#include <errno.h>        /* errno */
+#include <string.h>       /* strerror() */
+#include <stdio.h>        /* printf() etc. */
+#include <fcntl.h>        /* open(), posix_fadvise() */
+#include <unistd.h>       /* read(), pread(), close() */
+#include <inttypes.h>     /* int64_t */
+#include <time.h>         /* clock_gettime() */
+#ifdef USE_IO_URING
+#include <sys/syscall.h>  /* syscall(), __NR_io_uring_* */
+#include <sys/mman.h>     /* mmap(), munmap() */
+#include <linux/io_uring.h> /* io_uring structures and constants */
+#endif
+
+#include "mktorrent.h"
+
+#define EXPORT
+#endif /* ALLINONE */
+
+#include "prefetch.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined _LARGEFILE_SOURCE && defined O_LARGEFILE
+#define OPENFLAGS (O_RDONLY | O_BINARY | O_LARGEFILE)
+#else
+#define OPENFLAGS (O_RDONLY | O_BINARY)
+#endif
+
+/* a read counts as a stall when it takes longer than this
+   plus a microsecond per KiB it copies from the page cache */
+#ifndef STALL_USEC
+#define STALL_USEC 1000
+#endif
+
+/* files no bigger than this are read in one go without
+   checking for the end of file, and up to SMALL_BATCH of
+   them from the same directory are read in a batch */
+#ifndef SMALL_FILE
+#define SMALL_FILE 65536
+#endif
+#ifndef SMALL_BATCH
+#define SMALL_BATCH 64
+#endif
+
+/* files we don't open ahead, because they are small or on another
+   device, that we pass over looking for one to open before we give up
+   until the next time. the next time starts over after a jump, so
+   this keeps a long run of them from being walked again every piece */
+#ifndef AHEAD_SKIP
+#define AHEAD_SKIP 1024
+#endif
+
+/* reads failing with errors that may go away are tried again this
+   many times, waiting RETRY_USEC and twice as long every next time */
+#ifndef READ_RETRIES
+#define READ_RETRIES 5
+#endif
+#ifndef RETRY_USEC
+#define RETRY_USEC 100000
+#endif
+
+static void advise(int fd, off_t off, off_t len, int advice)
+{
+#ifdef POSIX_FADV_WILLNEED
+	/* this is only a hint, so don't bother the user if it fails */
+	posix_fadvise(fd, off, len, advice);
+#endif
+}
+
+static int64_t now_usec()
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	return (int64_t) time(NULL) * 1000000;
+#endif
+}
+
+/*
+ * what the error of a file we couldn't read means
+ */
+EXPORT const char *prefetch_strerror(int err)
+{
+	if (err == SHRANK)
+		return "File shrank while hashing";
+
+	return strerror(err);
+}
+
+/*
+ * give up on reading f, saying msg with the name of f and why, which is
+ * the errno it failed with or SHRANK. that's the end of us unless we
+ * keep going, which leaves it to the caller to carry on with zeros in
+ * place of what it couldn't read
+ */
+EXPORT void prefetch_fail(prefetch_t *pf, flist_t *f, const char *msg,
+		int err)
+{
+	if (f->error == 0)
+		fprintf(stderr, msg, f->path, prefetch_strerror(err));
+	if (!pf->keep_going)
+		exit(EXIT_FAILURE);
+	f->error = err;
+}
+
+/*
+ * whether to try a read that failed with errno again, after waiting
+ * a while for errors that may go away. tries counts the waits
+ */
+EXPORT int prefetch_retry(prefetch_t *pf, int *tries)
+{
+	struct timespec ts;
+	long usec;
+
+	if (errno == EINTR)
+		return 1;
+	if ((errno != EAGAIN && errno != EIO) || *tries >= READ_RETRIES)
+		return 0;
+
+	usec = (long) RETRY_USEC << (*tries)++;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = usec % 1000000 * 1000;
+	nanosleep(&ts, NULL);
+	pf->retries++;
+
+	return 1;
+}
+
+/*
+ * see if the file f open as fd still looks like it did when we scanned
+ * it, and mark it to be hashed again if it doesn't
+ */
+EXPORT void prefetch_check(prefetch_t *pf, flist_t *f, int fd)
+{
+	struct stat st;
+
+	if (f->changed || fstat(fd, &st))
+		return;
+
+	/* the members of a tar file that changed may
+	   have moved, so there's no hashing them again */
+	if (pf->tar) {
+		if (st.st_size != pf->tar_size || st.st_mtime != pf->tar_mtime
+				|| st.st_ctime != pf->tar_ctime
+				|| ST_MTIME_NSEC(&st) != pf->tar_mtime_nsec
+				|| ST_CTIME_NSEC(&st) != pf->tar_ctime_nsec) {
+			fprintf(stderr, "'%s' changed while hashing it.\n",
+					pf->tar);
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
+	if (st.st_size != f->size || st.st_mtime != f->mtime
+			|| st.st_ctime != f->ctime
+			|| ST_MTIME_NSEC(&st) != f->mtime_nsec
+			|| ST_CTIME_NSEC(&st) != f->ctime_nsec) {
+		f->changed = 1;
+		fprintf(stderr, "'%s' changed while hashing it.\n",
+				f->path);
+	}
+}
+
+/*
+ * we hit the end of f open as fd before reading f->size bytes, which is
+ * fine if it changed, as we'll hash it again anyway
+ */
+EXPORT void prefetch_shrank(prefetch_t *pf, flist_t *f, int fd)
+{
+	prefetch_check(pf, f, fd);
+	if (!f->changed)
+		prefetch_fail(pf, f, READ_ERROR, SHRANK);
+}
+
+static void close_fd(flist_t *f, int fd)
+{
+	if (close(fd)) {
+		fprintf(stderr, "Error closing '%s': %s\n",
+				f->path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * forget about the first i files in the window
+ */
+static void drop(prefetch_t *pf, unsigned int i)
+{
+	unsigned int j;
+
+	for (j = 0; j < i; j++)
+		close_fd(pf->files[j], pf->fds[j]);
+
+	pf->n -= i;
+	memmove(pf->files, pf->files + i, pf->n * sizeof(flist_t *));
+	memmove(pf->fds, pf->fds + i, pf->n * sizeof(int));
+}
+
+/*
+ * open files following the one being read until the window is full
+ * and ask the kernel to start reading them in the background.
+ * files on other devices are left for their own readers
+ */
+static void fill(prefetch_t *pf, flist_t *cur)
+{
+	unsigned int skipped = 0;
+
+	while (pf->n < pf->depth && pf->ahead) {
+		flist_t *f = pf->ahead;
+		int fd;
+
+		pf->ahead = f->next;
+		if (f->size <= SMALL_FILE || f->dev != cur->dev) {
+			if (++skipped == AHEAD_SKIP)
+				break;
+			continue;
+		}
+
+		/* if we can't open it now, we'll complain when we get
+		   to it for real */
+		if ((fd = open(f->path, OPENFLAGS)) == -1)
+			continue;
+
+		advise(fd, 0, pf->hint, POSIX_FADV_WILLNEED);
+		pf->files[pf->n] = f;
+		pf->fds[pf->n] = fd;
+		pf->n++;
+	}
+}
+
+/*
+ * length of the directory part of path, 0 if there is none
+ */
+static size_t dir_length(const char *path)
+{
+	const char *s = strrchr(path, DIRSEP[0]);
+
+	return s ? s - path : 0;
+}
+
+#ifdef AT_FDCWD
+/*
+ * return a directory file descriptor to open f relative to and point
+ * name at what to open there, so files in the same directory as the
+ * one before them don't have their whole path looked up again
+ */
+static int dir_of(prefetch_t *pf, flist_t *f, const char **name)
+{
+	size_t len = dir_length(f->path);
+
+	*name = f->path;
+	if (len == 0)
+		return AT_FDCWD;
+
+	if (pf->dirfd < 0 || len != pf->dir_len
+			|| strncmp(pf->dir, f->path, len)) {
+		if (pf->dirfd >= 0)
+			close(pf->dirfd);
+
+		pf->dir = realloc(pf->dir, len + 1);
+		if (pf->dir == NULL) {
+			fprintf(stderr, "Out of memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(pf->dir, f->path, len);
+		pf->dir[len] = '\0';
+		pf->dir_len = len;
+
+		/* if this fails, opening the file will tell us why */
+		pf->dirfd = open(pf->dir, O_RDONLY | O_DIRECTORY);
+		if (pf->dirfd < 0)
+			return AT_FDCWD;
+	}
+
+	*name = f->path + len + 1;
+	return pf->dirfd;
+}
+#endif /* AT_FDCWD */
+
+static int open_in_dir(prefetch_t *pf, flist_t *f)
+{
+#ifdef AT_FDCWD
+	const char *name;
+	int dirfd = dir_of(pf, f, &name);
+
+	return openat(dirfd, name, OPENFLAGS);
+#else
+	return open(f->path, OPENFLAGS);
+#endif
+}
+
+#ifdef USE_IO_URING
+/*
+ * just enough of an io_uring to submit a batch of requests
+ * and wait for all of them to complete
+ */
+struct uring_s {
+	int fd;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int tail;         /* our copy of the submission tail */
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+};
+
+static void uring_free(struct uring_s *u)
+{
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_size);
+	if (u->sq_ptr != MAP_FAILED)
+		munmap(u->sq_ptr, u->sq_size);
+	close(u->fd);
+	free(u);
+}
+
+/*
+ * set up a ring, or return NULL if the kernel won't let us
+ * in which case we just read the files one by one
+ */
+static struct uring_s *uring_new(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct uring_s *u;
+	unsigned char *sq;
+	unsigned char *cq;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0)
+		return NULL;
+
+	u = malloc(sizeof(struct uring_s));
+	if (u == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	u->fd = fd;
+	u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && u->cq_size > u->sq_size)
+		u->sq_size = u->cq_size;
+
+	u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ptr = u->sq_ptr;
+	else
+		u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED
+			|| u->sqes == MAP_FAILED) {
+		uring_free(u);
+		return NULL;
+	}
+
+	sq = u->sq_ptr;
+	cq = u->cq_ptr;
+	u->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+	u->sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	u->cq_head = (unsigned int *) (cq + p.cq_off.head);
+	u->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+	u->cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	u->tail = *u->sq_tail;
+
+	return u;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring_s *u, unsigned char op,
+		int fd, unsigned int i)
+{
+	unsigned int idx = u->tail++ & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = i;
+	u->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+/*
+ * submit the n requests queued and wait for them all to complete,
+ * storing the result of request i in res[i]
+ */
+static void uring_run(struct uring_s *u, unsigned int n, int *res)
+{
+	unsigned int submit = n;
+	unsigned int done = 0;
+
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+
+	while (done < n) {
+		unsigned int head = *u->cq_head;
+		unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		int r;
+
+		for (; head != tail; head++, done++) {
+			struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+			res[cqe->user_data] = cqe->res;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+		if (done == n)
+			break;
+
+		r = syscall(__NR_io_uring_enter, u->fd, submit, n - done,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error submitting reads: %s\n",
+					strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		submit -= r;
+	}
+}
+#endif /* USE_IO_URING */
+
+/*
+ * read all f->size bytes of f into buf. we trust the size we got
+ * when scanning, so there is no extra read to find the end of file
+ */
+static void read_all(prefetch_t *pf, flist_t *f, int fd, unsigned char *buf,
+		off_t done)
+{
+	int tries = 0;
+
+	while (done < f->size) {
+		ssize_t d = pread(fd, buf + done, f->size - done, done);
+
+		if (d < 0 && prefetch_retry(pf, &tries))
+			continue;
+
+		if (d < 0)
+			prefetch_fail(pf, f, READ_ERROR, errno);
+		else if (d == 0)
+			prefetch_shrank(pf, f, fd);
+		if (d <= 0) {
+			memset(buf + done, 0, f->size - done);
+			return;
+		}
+
+		done += d;
+		pf->reads++;
+	}
+}
+
+#ifdef USE_IO_URING
+/*
+ * open, read and close the k files in one go, three system calls in all.
+ * any request the kernel couldn't handle is done again the old way
+ */
+static void uring_read_small(prefetch_t *pf, flist_t **files,
+		unsigned char **bufs, unsigned int k)
+{
+	struct uring_s *u = pf->ring;
+	int fds[SMALL_BATCH];
+	int res[SMALL_BATCH];
+	const char *name;
+	size_t skip;
+	int dirfd;
+	unsigned int i;
+
+	dirfd = dir_of(pf, files[0], &name);
+	skip = name - files[0]->path;
+
+	for (i = 0; i < k; i++) {
+		struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_OPENAT,
+				dirfd, i);
+
+		sqe->addr = (uintptr_t) (files[i]->path + skip);
+		sqe->open_flags = OPENFLAGS;
+	}
+	uring_run(u, k, res);
+
+	for (i = 0; i < k; i++) {
+		struct io_uring_sqe *sqe;
+
+		fds[i] = res[i];
+		if (fds[i] < 0 && (fds[i] = open_in_dir(pf, files[i])) == -1) {
+			prefetch_fail(pf, files[i], OPEN_ERROR, errno);
+			memset(bufs[i], 0, files[i]->size);
+			uring_sqe(u, IORING_OP_NOP, -1, i);
+			continue;
+		}
+
+		sqe = uring_sqe(u, IORING_OP_READ, fds[i], i);
+		sqe->addr = (uintptr_t) bufs[i];
+		sqe->len = files[i]->size;
+		sqe->off = 0;
+	}
+	uring_run(u, k, res);
+
+	for (i = 0; i < k; i++) {
+		if (fds[i] < 0) {
+			uring_sqe(u, IORING_OP_NOP, -1, i);
+			continue;
+		}
+
+		if (res[i] < 0)
+			res[i] = 0;
+		pf->reads++;
+		read_all(pf, files[i], fds[i], bufs[i], res[i]);
+		prefetch_check(pf, files[i], fds[i]);
+
+		uring_sqe(u, IORING_OP_CLOSE, fds[i], i);
+	}
+	uring_run(u, k, res);
+
+	for (i = 0; i < k; i++) {
+		if (fds[i] < 0)
+			continue;
+		if (res[i] == -EINVAL)
+			close_fd(files[i], fds[i]);
+		else if (res[i] < 0) {
+			fprintf(stderr, "Error closing '%s': %s\n",
+					files[i]->path, strerror(-res[i]));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+#endif /* USE_IO_URING */
+
+EXPORT void prefetch_init(prefetch_t *pf, unsigned int depth, off_t hint)
+{
+	pf->depth = depth;
+	pf->n = 0;
+	pf->hint = hint;
+	pf->ahead = NULL;
+	pf->dir = NULL;
+	pf->dir_len = 0;
+	pf->dirfd = -1;
+#ifdef USE_IO_URING
+	pf->ring = uring_new(SMALL_BATCH);
+#else
+	pf->ring = NULL;
+#endif
+	pf->keep_going = 0;
+	pf->tar = NULL;
+	pf->tar_fd = -1;
+	pf->reads = 0;
+	pf->stalls = 0;
+	pf->stall_usec = 0;
+	pf->retries = 0;
+
+	if (depth == 0) {
+		pf->files = NULL;
+		pf->fds = NULL;
+		return;
+	}
+
+	pf->files = malloc(depth * sizeof(flist_t *));
+	pf->fds = malloc(depth * sizeof(int));
+	if (pf->files == NULL || pf->fds == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * read the files out of the tar file at path, all through one file
+ * descriptor, instead of opening them
+ */
+EXPORT void prefetch_tar(prefetch_t *pf, const char *path)
+{
+	struct stat st;
+
+	pf->tar = path;
+	pf->tar_fd = open(path, OPENFLAGS);
+	if (pf->tar_fd < 0 || fstat(pf->tar_fd, &st)) {
+		fprintf(stderr, OPEN_ERROR, path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	pf->tar_size = st.st_size;
+	pf->tar_mtime = st.st_mtime;
+	pf->tar_ctime = st.st_ctime;
+	pf->tar_mtime_nsec = ST_MTIME_NSEC(&st);
+	pf->tar_ctime_nsec = ST_CTIME_NSEC(&st);
+}
+
+/*
+ * return a file descriptor for reading f, either one we opened ahead
+ * or a new one, and top up the window with the files following it.
+ * returns -1 when we can't open it and keep going
+ */
+EXPORT int prefetch_open(prefetch_t *pf, flist_t *f)
+{
+	unsigned int i;
+	int fd;
+
+	if (pf->tar)
+		return pf->tar_fd;
+
+	for (i = 0; i < pf->n && pf->files[i] != f; i++);
+
+	if (i < pf->n) {
+		/* files before f in the window were skipped */
+		drop(pf, i);
+		/* take f out of the window without closing it */
+		fd = pf->fds[0];
+		pf->n--;
+		memmove(pf->files, pf->files + 1, pf->n * sizeof(flist_t *));
+		memmove(pf->fds, pf->fds + 1, pf->n * sizeof(int));
+	} else {
+		/* we jumped somewhere else, start over from here */
+		drop(pf, pf->n);
+		pf->ahead = f->next;
+
+		if ((fd = open_in_dir(pf, f)) == -1) {
+			prefetch_fail(pf, f, OPEN_ERROR, errno);
+			return -1;
+		}
+	}
+
+	advise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	fill(pf, f);
+
+	return fd;
+}
+
+EXPORT void prefetch_close(prefetch_t *pf, flist_t *f, int fd)
+{
+	if (fd != pf->tar_fd)
+		close_fd(f, fd);
+}
+
+/*
+ * count a read of r bytes that started at start, and whether
+ * it had to wait for the disk
+ */
+static void count_read(prefetch_t *pf, int64_t start, ssize_t r)
+{
+	int64_t usec = now_usec() - start;
+
+	pf->reads++;
+	if (r > 0 && usec > STALL_USEC + r / 1024) {
+		pf->stalls++;
+		pf->stall_usec += usec;
+	}
+}
+
+/*
+ * read from fd and keep track of how often we have to wait for the disk
+ */
+EXPORT ssize_t prefetch_read(prefetch_t *pf, int fd, void *buf, size_t len)
+{
+	int64_t start = now_usec();
+	ssize_t r = read(fd, buf, len);
+
+	count_read(pf, start, r);
+	return r;
+}
+
+/*
+ * the same reading from offset off, leaving the file position alone
+ */
+EXPORT ssize_t prefetch_pread(prefetch_t *pf, int fd, void *buf, size_t len,
+		off_t off)
+{
+	int64_t start = now_usec();
+	ssize_t r = pread(fd, buf, len, off);
+
+	count_read(pf, start, r);
+	return r;
+}
+
+/*
+ * read what is left of a part after the first done bytes
+ */
+static void read_rest(prefetch_t *pf, part_t *p, size_t done)
+{
+	int tries = 0;
+
+	while (done < p->len) {
+		ssize_t d = pread(p->fd, p->buf + done, p->len - done,
+				p->off + done);
+
+		if (d < 0 && prefetch_retry(pf, &tries))
+			continue;
+
+		if (d < 0)
+			prefetch_fail(pf, p->f, READ_ERROR, errno);
+		else if (d == 0)
+			prefetch_shrank(pf, p->f, p->fd);
+		if (d <= 0) {
+			memset(p->buf + done, 0, p->len - done);
+			return;
+		}
+
+		done += d;
+		pf->reads++;
+	}
+}
+
+/*
+ * read the k parts, SMALL_BATCH at a time in one system call when we
+ * have a ring. what a request didn't read is read the old way
+ */
+EXPORT void prefetch_read_parts(prefetch_t *pf, part_t *parts, unsigned int k)
+{
+	int res[SMALL_BATCH];
+	int64_t start = now_usec();
+	ssize_t bytes = 0;
+	unsigned int i, j, b;
+
+	for (i = 0; i < k; i += b) {
+		b = k - i < SMALL_BATCH ? k - i : SMALL_BATCH;
+		for (j = 0; j < b; j++)
+			res[j] = 0;
+
+#ifdef USE_IO_URING
+		if (pf->ring) {
+			for (j = 0; j < b; j++) {
+				part_t *p = parts + i + j;
+				struct io_uring_sqe *sqe = uring_sqe(pf->ring,
+						IORING_OP_READ, p->fd, j);
+
+				sqe->addr = (uintptr_t) p->buf;
+				sqe->len = p->len;
+				sqe->off = p->off;
+			}
+			uring_run(pf->ring, b, res);
+		}
+#endif
+
+		for (j = 0; j < b; j++) {
+			if (res[j] < 0)
+				res[j] = 0;
+			pf->reads++;
+			read_rest(pf, parts + i + j, res[j]);
+			bytes += parts[i + j].len;
+		}
+	}
+
+	/* count_read() counts one more read */
+	pf->reads--;
+	count_read(pf, start, bytes);
+}
+
+/*
+ * count how many small files, starting with f and all in the same
+ * directory, fit in space bytes with their padding so they can be
+ * read in one batch
+ */
+EXPORT unsigned int prefetch_small_files(flist_t *f, size_t space)
+{
+	const char *dir = f->path;
+	size_t len = dir_length(dir);
+	unsigned int n = 0;
+
+	while (f && n < SMALL_BATCH && f->size <= SMALL_FILE
+			&& (size_t) (f->size + f->pad) <= space
+			&& dir_length(f->path) == len
+			&& strncmp(f->path, dir, len) == 0) {
+		space -= f->size + f->pad;
+		f = f->next;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * read the n small files starting with f into buf one after another,
+ * each followed by its padding, and return the number of bytes put
+ * in buf
+ */
+EXPORT size_t prefetch_read_small(prefetch_t *pf, flist_t *f, unsigned int n,
+		unsigned char *buf)
+{
+	flist_t *files[SMALL_BATCH];
+	unsigned char *bufs[SMALL_BATCH];
+	unsigned char *start = buf;
+	unsigned int k = 0;
+	unsigned int i;
+	int64_t usec = now_usec();
+
+	/* there is nothing to read in empty files, and
+	   the padding following a file is just zeros */
+	for (i = 0; i < n; i++, f = f->next) {
+		if (f->size) {
+			files[k] = f;
+			bufs[k] = buf;
+			buf += f->size;
+			k++;
+		}
+		memset(buf, 0, f->pad);
+		buf += f->pad;
+	}
+
+	if (k == 0)
+		return buf - start;
+
+	/* members of a tar file are parts of it */
+	if (pf->tar) {
+		part_t parts[SMALL_BATCH];
+
+		for (i = 0; i < k; i++) {
+			parts[i].f = files[i];
+			parts[i].fd = pf->tar_fd;
+			parts[i].off = files[i]->offset;
+			parts[i].buf = bufs[i];
+			parts[i].len = files[i]->size;
+		}
+		prefetch_read_parts(pf, parts, k);
+		prefetch_check(pf, files[0], pf->tar_fd);
+
+		return buf - start;
+	}
+
+#ifdef USE_IO_URING
+	if (pf->ring)
+		uring_read_small(pf, files, bufs, k);
+	else
+#endif
+	for (i = 0; i < k; i++) {
+		int fd = open_in_dir(pf, files[i]);
+
+		if (fd == -1) {
+			prefetch_fail(pf, files[i], OPEN_ERROR, errno);
+			memset(bufs[i], 0, files[i]->size);
+			continue;
+		}
+		read_all(pf, files[i], fd, bufs[i], 0);
+		prefetch_check(pf, files[i], fd);
+		close_fd(files[i], fd);
+	}
+
+	usec = now_usec() - usec;
+	if (usec > STALL_USEC + (buf - start) / 1024) {
+		pf->stalls++;
+		pf->stall_usec += usec;
+	}
+
+	return buf - start;
+}
+
+/*
+ * close the files still open ahead
+ */
+EXPORT void prefetch_done(prefetch_t *pf)
+{
+	drop(pf, pf->n);
+	free(pf->files);
+	free(pf->fds);
+	if (pf->tar_fd >= 0)
+		close(pf->tar_fd);
+	if (pf->dirfd >= 0)
+		close(pf->dirfd);
+	free(pf->dir);
+#ifdef USE_IO_URING
+	if (pf->ring)
+		uring_free(pf->ring);
+#endif
+}
+
+EXPORT void prefetch_print_stats(prefetch_t *pf)
+{
+	printf("%lu reads, %lu of them waited for the disk "
+			"(%" PRId64 ".%03u seconds in all).\n",
+			pf->reads, pf->stalls, pf->stall_usec / 1000000,
+			(unsigned int) (pf->stall_usec / 1000 % 1000));
+	if (pf->retries)
+		printf("Retried failed reads %lu times.\n",
+				pf->retries);
+}
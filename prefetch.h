@@ -0,0 +1,80 @@
+#ifndef _PREFETCH_H
+#define _PREFETCH_H
+
+struct uring_s;
+
+/*
+ * a window of files opened ahead of the one being read
+ */
+struct prefetch_s;
+typedef struct prefetch_s prefetch_t;
+struct prefetch_s {
+	unsigned int depth;        /* max number of files opened ahead */
+	unsigned int n;            /* number of files opened ahead */
+	off_t hint;                /* bytes to ask for from every file */
+	flist_t **files;           /* files opened ahead in list order */
+	int *fds;                  /* ..and their file descriptors */
+	flist_t *ahead;            /* next file to open ahead */
+	char *dir;                 /* directory of the last file opened */
+	size_t dir_len;            /* ..the length of its name */
+	int dirfd;                 /* ..and a file descriptor for it */
+	struct uring_s *ring;      /* for batching reads of small files */
+	int keep_going;            /* carry on past files we can't read */
+	const char *tar;           /* tar file the files are members of */
+	int tar_fd;                /* ..open to read all of them */
+	off_t tar_size;            /* ..and what it looked like then */
+	time_t tar_mtime;
+	time_t tar_ctime;
+	long tar_mtime_nsec;
+	long tar_ctime_nsec;
+
+	/* read statistics */
+	unsigned long reads;       /* number of reads */
+	unsigned long stalls;      /* reads that had to wait for the disk */
+	int64_t stall_usec;        /* time spent waiting in those */
+	unsigned long retries;     /* reads tried again after failing */
+};
+
+/* what prefetch_fail() says */
+#define OPEN_ERROR "Error opening '%s' for reading: %s\n"
+#define READ_ERROR "Error reading from '%s': %s\n"
+
+/* the error of a file that shrank while hashing it, which isn't an errno */
+#define SHRANK (-1)
+
+/*
+ * a part of a file to read into a buffer
+ */
+struct part_s;
+typedef struct part_s part_t;
+struct part_s {
+	flist_t *f;
+	int fd;
+	off_t off;
+	unsigned char *buf;
+	size_t len;
+};
+
+#ifndef ALLINONE
+void prefetch_fail(prefetch_t *pf, flist_t *f, const char *msg,
+		int err);
+const char *prefetch_strerror(int err);
+int prefetch_retry(prefetch_t *pf, int *tries);
+void prefetch_check(prefetch_t *pf, flist_t *f, int fd);
+void prefetch_shrank(prefetch_t *pf, flist_t *f, int fd);
+void prefetch_init(prefetch_t *pf, unsigned int depth, off_t hint);
+void prefetch_tar(prefetch_t *pf, const char *path);
+int prefetch_open(prefetch_t *pf, flist_t *f);
+void prefetch_close(prefetch_t *pf, flist_t *f, int fd);
+ssize_t prefetch_read(prefetch_t *pf, int fd, void *buf, size_t len);
+ssize_t prefetch_pread(prefetch_t *pf, int fd, void *buf, size_t len,
+		off_t off);
+void prefetch_read_parts(prefetch_t *pf, part_t *parts, unsigned int k);
+unsigned int prefetch_small_files(flist_t *f, size_t space);
+size_t prefetch_read_small(prefetch_t *pf, flist_t *f, unsigned int n,
+		unsigned char *buf);
+void prefetch_done(prefetch_t *pf);
+void prefetch_print_stats(prefetch_t *pf);
+#endif /* ALLINONE */
+
+#endif /* _PREFETCH_H */
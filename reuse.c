@@ -0,0 +1,525 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2007, 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef ALLINONE
+#include <stdlib.h>       /* exit(), malloc(), qsort() */
+#include <sys/types.h>    /* off_t */
+#include <sys/stat.h>     /* fstat() */
+#include <errno.h>        /* errno */
+#include <string.h>       /* strerror(), memcmp() */
+#include <stdio.h>        /* printf() etc. */
+#include <fcntl.h>        /* open() */
+#include <unistd.h>       /* write(), close(), ftruncate() */
+#include <inttypes.h>     /* uint64_t etc. */
+#include <time.h>         /* time() */
+
+#ifdef USE_OPENSSL
+#include <openssl/sha.h>  /* SHA_DIGEST_LENGTH */
+#else
+#include "sha1.h"
+#endif
+
+#include "mktorrent.h"
+
+#define EXPORT
+#endif /* ALLINONE */
+
+#include "reuse.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* glibc only has these with _GNU_SOURCE, the kernel has had them since 3.1 */
+#if !defined(SEEK_HOLE) && defined(__linux__)
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+#if defined(O_LARGEFILE)
+#define OPENFLAGS (O_RDONLY | O_BINARY | O_LARGEFILE)
+#else
+#define OPENFLAGS (O_RDONLY | O_BINARY)
+#endif
+
+/*
+ * the hash cache starts with this line, followed by a record for every
+ * file it knows. each record is followed by the hashes of the whole
+ * pieces of the file, as they are when the file starts on a piece
+ * boundary. the cache is only meant for the machine that wrote it, so
+ * the numbers are stored the way the machine stores them
+ */
+#define CACHE_MAGIC "mktorrent hash cache 1\n"
+
+struct record_s;
+typedef struct record_s record_t;
+struct record_s {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime;
+	uint32_t piece_length;
+	uint32_t pieces;           /* number of hashes following */
+};
+
+/*
+ * a file starting on a piece boundary, so its whole pieces hash the
+ * same as those of any other file with the same contents that does.
+ * a padded file ends on a piece boundary too, so the last piece
+ * counts as whole
+ */
+struct ident_s {
+	flist_t *f;
+	unsigned int first;        /* first piece of the file */
+	unsigned int pieces;       /* whole pieces in the file */
+};
+
+static int compare_ids(const void *a, const void *b)
+{
+	const struct ident_s *x = a;
+	const struct ident_s *y = b;
+	uint64_t x_dev = x->f->dev, y_dev = y->f->dev;
+	uint64_t x_ino = x->f->ino, y_ino = y->f->ino;
+
+	if (x_dev != y_dev)
+		return x_dev < y_dev ? -1 : 1;
+	if (x_ino != y_ino)
+		return x_ino < y_ino ? -1 : 1;
+	return x->first < y->first ? -1 : x->first > y->first;
+}
+
+static int same_file(const struct ident_s *x, const struct ident_s *y)
+{
+	return x->f->dev == y->f->dev && x->f->ino == y->f->ino;
+}
+
+/*
+ * find the first of the files that are links to the inode ino on the
+ * device dev, or return NULL if there are none
+ */
+static struct ident_s *find_file(reuse_t *ru, uint64_t dev, uint64_t ino)
+{
+	unsigned int lo = 0;
+	unsigned int hi = ru->ids_len;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		flist_t *f = ru->ids[mid].f;
+
+		if ((uint64_t) f->dev < dev || ((uint64_t) f->dev == dev
+					&& (uint64_t) f->ino < ino))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == ru->ids_len || (uint64_t) ru->ids[lo].f->dev != dev
+			|| (uint64_t) ru->ids[lo].f->ino != ino)
+		return NULL;
+
+	return ru->ids + lo;
+}
+
+/*
+ * fill out the hashes of the files the hash cache knows, and note where
+ * its last whole record ends so we can append to it when we're done
+ */
+static void read_cache(reuse_t *ru, metafile_t *m, unsigned char *hash_string)
+{
+	char magic[sizeof(CACHE_MAGIC) - 1];
+	struct stat st;
+	record_t rec;
+	off_t pos;
+	unsigned int i;
+	FILE *f;
+
+	ru->cache_end = -1;
+
+	if ((f = fopen(m->hash_cache, "rb")) == NULL) {
+		if (errno == ENOENT)
+			ru->cache_end = 0;
+		else
+			fprintf(stderr, "Warning: cannot read the hash cache "
+				"'%s': %s\n", m->hash_cache, strerror(errno));
+		return;
+	}
+
+	if (fstat(fileno(f), &st) || (st.st_size > 0
+				&& (fread(magic, sizeof(magic), 1, f) != 1
+				|| memcmp(magic, CACHE_MAGIC, sizeof(magic))))) {
+		fprintf(stderr, "Warning: '%s' is not a hash cache, "
+			"leaving it alone.\n", m->hash_cache);
+		fclose(f);
+		return;
+	}
+
+	pos = st.st_size > 0 ? (off_t) sizeof(magic) : 0;
+	while (pos + (off_t) sizeof(rec) <= st.st_size
+			&& fread(&rec, sizeof(rec), 1, f) == 1) {
+		off_t len = (off_t) rec.pieces * SHA_DIGEST_LENGTH;
+		struct ident_s *id;
+
+		/* a run that was cut short may have left half a record */
+		if (len > st.st_size - pos - (off_t) sizeof(rec))
+			break;
+
+		id = find_file(ru, rec.dev, rec.ino);
+		if (id && rec.size == (int64_t) id->f->size
+				&& rec.mtime == (int64_t) id->f->mtime
+				&& rec.piece_length == m->piece_length
+				&& rec.pieces == id->pieces
+				&& ru->from[id->first] == id->first) {
+			if (fread(hash_string + id->first * SHA_DIGEST_LENGTH,
+					len, 1, f) != 1)
+				break;
+			for (i = 0; i < rec.pieces; i++)
+				ru->from[id->first + i] = REUSE_CACHED;
+			ru->cached += rec.pieces;
+		} else if (fseeko(f, len, SEEK_CUR))
+			break;
+
+		pos += sizeof(rec) + (off_t) rec.pieces * SHA_DIGEST_LENGTH;
+	}
+	fclose(f);
+
+	ru->cache_end = pos;
+}
+
+/*
+ * write all of buf to fd, returning -1 if we couldn't
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * append records of the files we read to the hash cache. files changed
+ * in the second we started reading or later are left out, as they may
+ * change again without their modification time telling us, and so are
+ * files we couldn't read or saw change. a cache
+ * shouldn't be shared by runs at the same time
+ */
+static void write_cache(reuse_t *ru, metafile_t *m, unsigned char *hash_string)
+{
+	unsigned char *buf = NULL;
+	size_t alloc = 0;
+	unsigned int i;
+	int fd;
+
+	if (ru->cache_end < 0)
+		return;
+
+	fd = open(m->hash_cache, O_WRONLY | O_CREAT | O_BINARY, 0666);
+	if (fd < 0 || ftruncate(fd, ru->cache_end)
+			|| lseek(fd, ru->cache_end, SEEK_SET) < 0
+			|| (ru->cache_end == 0 && write_all(fd, CACHE_MAGIC,
+					sizeof(CACHE_MAGIC) - 1)))
+		goto error;
+
+	for (i = 0; i < ru->ids_len; i++) {
+		struct ident_s *id = ru->ids + i;
+		size_t len = sizeof(record_t)
+			+ (size_t) id->pieces * SHA_DIGEST_LENGTH;
+		record_t rec;
+
+		/* only the first of a bunch of hard links, and
+		   only what the cache didn't know already */
+		if ((i > 0 && same_file(id - 1, id))
+				|| ru->from[id->first] == REUSE_CACHED
+				|| id->f->mtime >= ru->start
+				|| id->f->error || id->f->changed)
+			continue;
+
+		if (len > alloc) {
+			alloc = len;
+			free(buf);
+			if ((buf = malloc(alloc)) == NULL) {
+				fprintf(stderr, "Out of memory.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		rec.dev = id->f->dev;
+		rec.ino = id->f->ino;
+		rec.size = id->f->size;
+		rec.mtime = id->f->mtime;
+		rec.piece_length = m->piece_length;
+		rec.pieces = id->pieces;
+		memcpy(buf, &rec, sizeof(rec));
+		memcpy(buf + sizeof(rec),
+				hash_string + id->first * SHA_DIGEST_LENGTH,
+				len - sizeof(rec));
+
+		/* one write per record, so a record is either
+		   all there or at the end where we'll find it */
+		if (write_all(fd, buf, len))
+			goto error;
+	}
+
+	free(buf);
+	if (close(fd) == 0)
+		return;
+	fd = -1;
+
+error:
+	fprintf(stderr, "Warning: cannot write the hash cache '%s': %s\n",
+			m->hash_cache, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+}
+
+/*
+ * hash len zeros
+ */
+static void hash_zeros(SHA_CTX *c, unsigned long len)
+{
+#ifdef USE_OPENSSL
+	static const unsigned char zeros[4096];
+
+	for (; len > sizeof(zeros); len -= sizeof(zeros))
+		SHA1_Update(c, zeros, sizeof(zeros));
+	SHA1_Update(c, zeros, len);
+#else
+	SHA1_UpdateZeros(c, len);
+#endif
+}
+
+/*
+ * the hash of a piece of zeros, worked out once for every piece length
+ */
+static const unsigned char *zero_piece(unsigned int piece_length)
+{
+	static unsigned char digests[32][SHA_DIGEST_LENGTH];
+	static unsigned int lengths[32];
+	unsigned int i = 0;
+	SHA_CTX c;
+
+	while (i < 31 && (1U << i) < piece_length)
+		i++;
+
+	if (lengths[i] != piece_length) {
+		SHA1_Init(&c);
+		hash_zeros(&c, piece_length);
+		SHA1_Final(digests[i], &c);
+		lengths[i] = piece_length;
+	}
+
+	return digests[i];
+}
+
+/*
+ * the whole pieces in holes of sparse files are all zeros, so they get
+ * the hash of a piece of zeros without reading them. a hole running to
+ * the end of a padded file runs on into the padding. pieces that are
+ * only partly in a hole are read as usual
+ */
+static void find_holes(reuse_t *ru, metafile_t *m, unsigned char *hash_string)
+{
+#ifdef SEEK_HOLE
+	const int64_t pl = m->piece_length;
+	flist_t *f;
+	int64_t off = 0;
+
+	for (f = m->file_list; f; off += f->size + f->pad, f = f->next) {
+		off_t hole, data = 0;
+		int fd;
+
+		/* leave files we can't open for when we read them */
+		if (!f->sparse || f->size + f->pad < (off_t) pl
+				|| (fd = open(f->path, OPENFLAGS)) < 0)
+			continue;
+
+		while (data < f->size
+				&& (hole = lseek(fd, data, SEEK_HOLE)) >= 0
+				&& hole < f->size) {
+			int64_t i, end;
+
+			data = lseek(fd, hole, SEEK_DATA);
+			if (data < 0 || data > f->size)
+				data = f->size;
+			end = off + data + (data == f->size ? f->pad : 0);
+
+			for (i = (off + hole + pl - 1) / pl;
+					i < end / pl && i < m->pieces; i++)
+				if (!REUSED(ru, i)) {
+					ru->from[i] = REUSE_ZERO;
+					memcpy(hash_string + i * SHA_DIGEST_LENGTH,
+						zero_piece(m->piece_length),
+						SHA_DIGEST_LENGTH);
+					ru->zeros++;
+				}
+		}
+
+		close(fd);
+	}
+#endif /* SEEK_HOLE */
+}
+
+/*
+ * work out which pieces we know the hashes of before reading anything.
+ * the whole pieces of hard links to the same file, starting on a piece
+ * boundary, are the same as those of the first of them. the hashes of
+ * pieces the hash cache has, and of pieces in holes, are filled out
+ * right away
+ */
+EXPORT void reuse_init(reuse_t *ru, metafile_t *m, unsigned char *hash_string)
+{
+	flist_t *f;
+	int64_t off = 0;
+	unsigned int i, j, k;
+
+	ru->from = malloc((m->pieces ? m->pieces : 1) * sizeof(unsigned int));
+	for (i = 0; ru->from && i < m->pieces; i++)
+		ru->from[i] = i;
+	ru->ids = NULL;
+	ru->ids_len = 0;
+	ru->start = time(NULL);
+	ru->cache_end = -1;
+	ru->reused = 0;
+	ru->cached = 0;
+	ru->zeros = 0;
+
+	/* count the files we could reuse the hashes of */
+	for (f = m->file_list; f; off += f->size + f->pad, f = f->next)
+		if (off % m->piece_length == 0
+				&& f->size + f->pad >= (off_t) m->piece_length
+				&& f->ino != 0)
+			ru->ids_len++;
+
+	if (ru->ids_len)
+		ru->ids = malloc(ru->ids_len * sizeof(struct ident_s));
+	if (ru->from == NULL || (ru->ids_len && ru->ids == NULL)) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	i = 0;
+	off = 0;
+	for (f = m->file_list; f; off += f->size + f->pad, f = f->next)
+		if (off % m->piece_length == 0
+				&& f->size + f->pad >= (off_t) m->piece_length
+				&& f->ino != 0) {
+			ru->ids[i].f = f;
+			ru->ids[i].first = off / m->piece_length;
+			ru->ids[i].pieces = (f->size + f->pad)
+				/ m->piece_length;
+			i++;
+		}
+
+	/* put hard links next to each other, first one first */
+	qsort(ru->ids, ru->ids_len, sizeof(struct ident_s), compare_ids);
+
+	/* pieces that didn't change since we hashed them before leaving
+	   out files with -k or noticing that files changed */
+	for (i = 0; m->kept && i < m->pieces; i++)
+		if (m->kept[i]) {
+			ru->from[i] = REUSE_KEPT;
+			memcpy(hash_string + i * SHA_DIGEST_LENGTH,
+				m->hash_string + i * SHA_DIGEST_LENGTH,
+				SHA_DIGEST_LENGTH);
+		}
+
+	if (m->hash_cache)
+		read_cache(ru, m, hash_string);
+
+	for (i = 0; i < ru->ids_len; i = j)
+		for (j = i + 1; j < ru->ids_len
+				&& same_file(ru->ids + i, ru->ids + j); j++)
+			for (k = 0; k < ru->ids[j].pieces
+					&& k < ru->ids[i].pieces; k++)
+				ru->from[ru->ids[j].first + k] =
+					ru->ids[i].first + k;
+
+	find_holes(ru, m, hash_string);
+
+	for (i = 0; i < m->pieces; i++)
+		if (REUSED(ru, i))
+			ru->reused++;
+}
+
+/*
+ * fill out the pieces of another piece length that lie in the pieces
+ * we didn't read, except for the ones we kept, which are there already
+ */
+static void reuse_length(reuse_t *ru, metafile_t *m, plist_t *p)
+{
+	size_t n = m->piece_length / p->piece_length;
+	size_t len = n * SHA_DIGEST_LENGTH;
+	unsigned int i, j;
+
+	for (i = 0; i < m->pieces; i++) {
+		unsigned char *dest = p->hash_string + i * len;
+
+		if (ru->from[i] == REUSE_ZERO)
+			for (j = 0; j < n; j++)
+				memcpy(dest + j * SHA_DIGEST_LENGTH,
+					zero_piece(p->piece_length),
+					SHA_DIGEST_LENGTH);
+		else if (REUSED(ru, i) && ru->from[i] != REUSE_CACHED
+				&& ru->from[i] != REUSE_KEPT)
+			memcpy(dest, p->hash_string + ru->from[i] * len, len);
+	}
+}
+
+/*
+ * copy the hashes of the pieces of hard links from the pieces we read,
+ * at every piece length, and remember what we read in the hash cache
+ */
+EXPORT void reuse_done(reuse_t *ru, metafile_t *m, unsigned char *hash_string)
+{
+	plist_t *p;
+	unsigned int i;
+
+	for (i = 0; i < m->pieces; i++)
+		if (ru->from[i] != i && ru->from[i] != REUSE_CACHED
+				&& ru->from[i] != REUSE_ZERO
+				&& ru->from[i] != REUSE_KEPT)
+			memcpy(hash_string + i * SHA_DIGEST_LENGTH,
+				hash_string + ru->from[i] * SHA_DIGEST_LENGTH,
+				SHA_DIGEST_LENGTH);
+
+	for (p = m->lengths; p; p = p->next)
+		reuse_length(ru, m, p);
+
+	if (m->hash_cache)
+		write_cache(ru, m, hash_string);
+
+	if (m->verbose && ru->reused)
+		printf("Reused the hashes of %u pieces, %u of them "
+				"from the hash cache and %u of them "
+				"in holes.\n",
+				ru->reused, ru->cached, ru->zeros);
+
+	free(ru->from);
+	free(ru->ids);
+}
@@ -0,0 +1,40 @@
+#ifndef _REUSE_H
+#define _REUSE_H
+
+struct ident_s;
+
+/*
+ * the hashes of pieces we know without reading them, because they are
+ * pieces of a hard link to a file we read anyway, the hash cache has
+ * them from an earlier run, they lie in a hole of a sparse file or
+ * come before a file we left out after hashing them
+ */
+struct reuse_s;
+typedef struct reuse_s reuse_t;
+struct reuse_s {
+	unsigned int *from;        /* piece to copy the hash of, REUSE_CACHED,
+	                              REUSE_ZERO, REUSE_KEPT or the piece
+	                              itself when we must read it */
+	struct ident_s *ids;       /* files starting on a piece boundary */
+	unsigned int ids_len;      /* ..and how many there are */
+	time_t start;              /* when we started reading */
+	off_t cache_end;           /* end of the last whole record in the
+	                              cache, -1 if we shouldn't write it */
+	unsigned int reused;       /* pieces we don't have to read */
+	unsigned int cached;       /* ..of which the cache had */
+	unsigned int zeros;        /* ..and which are all zeros */
+};
+
+#define REUSE_CACHED ((unsigned int) -1)
+#define REUSE_ZERO   ((unsigned int) -2)
+#define REUSE_KEPT   ((unsigned int) -3)
+
+/* whether we know the hash of piece i without reading it */
+#define REUSED(ru, i) ((ru)->from[i] != (unsigned int) (i))
+
+#ifndef ALLINONE
+void reuse_init(reuse_t *ru, metafile_t *m, unsigned char *hash_string);
+void reuse_done(reuse_t *ru, metafile_t *m, unsigned char *hash_string);
+#endif /* ALLINONE */
+
+#endif /* _REUSE_H */
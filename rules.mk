@@ -15,7 +15,7 @@
 # along with this program; if not, write to the Free Software
 # Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
 
-.PHONY: strip indent clean install uninstall
+.PHONY: strip indent check bench clean install uninstall
 
 prefix: prefix.c
 	$(CC) $(CFLAGS) $(DEFINES) $(LDFLAGS) $< -o $@
@@ -32,6 +32,17 @@ strip:
 indent:
 	indent -kr -i8 *.c *.h
 
+check:
+	CC="$(CC)" CFLAGS="$(CFLAGS)" LDFLAGS="$(LDFLAGS)" MAKE="$(MAKE)" \
+	USE_OPENSSL="$(USE_OPENSSL)" USE_IO_URING="$(USE_IO_URING)" \
+	USE_LONG_OPTIONS="$(USE_LONG_OPTIONS)" \
+	USE_LARGE_FILES="$(USE_LARGE_FILES)" sh tests/check.sh
+
+bench:
+	CC="$(CC)" CFLAGS="$(CFLAGS)" LDFLAGS="$(LDFLAGS)" MAKE="$(MAKE)" \
+	USE_OPENSSL="$(USE_OPENSSL)" USE_LONG_OPTIONS="$(USE_LONG_OPTIONS)" \
+	USE_LARGE_FILES="$(USE_LARGE_FILES)" sh tests/small_files.sh
+
 clean:
 	rm -f $(program) prefix *.o *.c~ *.h~
 
@@ -22,6 +22,7 @@
 #endif
 #include <string.h>
 #include <inttypes.h>
+#include <sys/uio.h>
 
 #define EXPORT
 #endif /* ALLINONE */
@@ -49,6 +50,12 @@
 #define R3(v,w,x,y,z,i) z+=(((w|x)&y)|(w&x))+blk(i)+0x8F1BBCDC+rol(v,5);w=rol(w,30);
 #define R4(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0xCA62C1D6+rol(v,5);w=rol(w,30);
 
+/* the same for a block of zeros, which expands to nothing but zeros */
+#define Z1(v,w,x,y,z) z+=((w&(x^y))^y)+0x5A827999+rol(v,5);w=rol(w,30);
+#define Z2(v,w,x,y,z) z+=(w^x^y)+0x6ED9EBA1+rol(v,5);w=rol(w,30);
+#define Z3(v,w,x,y,z) z+=(((w|x)&y)|(w&x))+0x8F1BBCDC+rol(v,5);w=rol(w,30);
+#define Z4(v,w,x,y,z) z+=(w^x^y)+0xCA62C1D6+rol(v,5);w=rol(w,30);
+
 
 #ifdef SHA1_VERBOSE
 static void SHAPrintContext(SHA_CTX *context, char *msg){
@@ -123,6 +130,58 @@ static void SHA1_Transform(uint32_t state[5], const uint8_t buffer[64])
 #endif
 }
 
+/* The block ending a piece of 2^n bytes: 0x80, zeros and the length
+ * in bits, which is a multiple of 256 that fits in 32 bits. */
+#define Z8 0, 0, 0, 0, 0, 0, 0, 0
+#define LAST_BLOCK(n) { 0x80, 0, 0, 0, 0, 0, 0, 0, Z8, Z8, Z8, Z8, Z8, Z8, \
+	0, 0, 0, 0, (uint8_t) ((1UL << ((n) + 3)) >> 24), \
+	(uint8_t) ((1UL << ((n) + 3)) >> 16), \
+	(uint8_t) ((1UL << ((n) + 3)) >> 8), 0 }
+
+#define PIECE_MIN 15
+#define PIECE_MAX 28
+
+static const uint8_t last_blocks[PIECE_MAX - PIECE_MIN + 1][64] = {
+	LAST_BLOCK(15), LAST_BLOCK(16), LAST_BLOCK(17), LAST_BLOCK(18),
+	LAST_BLOCK(19), LAST_BLOCK(20), LAST_BLOCK(21), LAST_BLOCK(22),
+	LAST_BLOCK(23), LAST_BLOCK(24), LAST_BLOCK(25), LAST_BLOCK(26),
+	LAST_BLOCK(27), LAST_BLOCK(28)
+};
+
+/* Hash a 512-bit block of zeros without expanding it. */
+static void SHA1_TransformZero(uint32_t state[5])
+{
+	uint32_t a = state[0];
+	uint32_t b = state[1];
+	uint32_t c = state[2];
+	uint32_t d = state[3];
+	uint32_t e = state[4];
+	int i;
+
+	for (i = 0; i < 20; i += 5) {
+		Z1(a,b,c,d,e); Z1(e,a,b,c,d); Z1(d,e,a,b,c);
+		Z1(c,d,e,a,b); Z1(b,c,d,e,a);
+	}
+	for (i = 0; i < 20; i += 5) {
+		Z2(a,b,c,d,e); Z2(e,a,b,c,d); Z2(d,e,a,b,c);
+		Z2(c,d,e,a,b); Z2(b,c,d,e,a);
+	}
+	for (i = 0; i < 20; i += 5) {
+		Z3(a,b,c,d,e); Z3(e,a,b,c,d); Z3(d,e,a,b,c);
+		Z3(c,d,e,a,b); Z3(b,c,d,e,a);
+	}
+	for (i = 0; i < 20; i += 5) {
+		Z4(a,b,c,d,e); Z4(e,a,b,c,d); Z4(d,e,a,b,c);
+		Z4(c,d,e,a,b); Z4(b,c,d,e,a);
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
 /* SHA1Init - Initialize new context */
 EXPORT void SHA1_Init(SHA_CTX *context)
 {
@@ -167,6 +226,62 @@ EXPORT void SHA1_Update(SHA_CTX *context, const uint8_t *data, unsigned long len
 #endif
 }
 
+/* Run len zero bytes through this without reading any memory. */
+EXPORT void SHA1_UpdateZeros(SHA_CTX *context, unsigned long len)
+{
+	static const uint8_t zeros[64];
+	unsigned long n = (64 - ((context->count[0] >> 3) & 63)) & 63;
+
+	/* fill up what is left of a partial block */
+	if (n > len)
+		n = len;
+	SHA1_Update(context, zeros, n);
+	len -= n;
+
+	n = len & ~63UL;
+	if ((context->count[0] += n << 3) < (n << 3))
+		context->count[1]++;
+	context->count[1] += (n >> 29);
+	for (; n; n -= 64)
+		SHA1_TransformZero(context->state);
+
+	SHA1_Update(context, zeros, len & 63);
+}
+
+/* Run a list of segments through this as if they were one buffer.
+ * A segment without a base is that many zeros. The segments are only
+ * read, every block going through the context buffer on its way to
+ * SHA1_Transform(), so they may be read-only mappings. */
+EXPORT void SHA1_UpdateV(SHA_CTX *context, const struct iovec *iov, int n)
+{
+	for (; n > 0; n--, iov++) {
+		const uint8_t *data = iov->iov_base;
+		size_t len = iov->iov_len;
+		size_t j, k;
+
+		if (data == NULL) {
+			SHA1_UpdateZeros(context, len);
+			continue;
+		}
+
+		j = (context->count[0] >> 3) & 63;
+
+		if ((context->count[0] += len << 3) < (len << 3))
+			context->count[1]++;
+		context->count[1] += (len >> 29);
+
+		for (; len; data += k, len -= k) {
+			k = 64 - j < len ? 64 - j : len;
+			memcpy(&context->buffer[j], data, k);
+			j += k;
+			if (j == 64) {
+				SHA1_Transform(context->state, context->buffer);
+				j = 0;
+			}
+		}
+	}
+}
+
 /* Add padding and return the message digest. */
 EXPORT void SHA1_Final(uint8_t *digest, SHA_CTX *context)
 {
@@ -203,6 +318,38 @@ EXPORT void SHA1_Final(uint8_t *digest, SHA_CTX *context)
 #endif
 }
 
+/* Hash len bytes in one go, like SHA1() of OpenSSL. Whole pieces of
+ * 2^15 to 2^28 bytes go through SHA1_Transform() block by block, with
+ * none of the bookkeeping of SHA1_Update(), and end with the last
+ * block made for their length above. Like SHA1_Update() this
+ * scribbles on data. */
+EXPORT uint8_t *SHA1(const uint8_t *data, unsigned long len, uint8_t *digest)
+{
+	SHA_CTX context;
+	int i;
+
+	for (i = PIECE_MIN; i <= PIECE_MAX && len != 1UL << i; i++);
+
+	SHA1_Init(&context);
+	if (i > PIECE_MAX) {
+		SHA1_Update(&context, data, len);
+		SHA1_Final(digest, &context);
+		return digest;
+	}
+
+	for (; len; data += 64, len -= 64)
+		SHA1_Transform(context.state, data);
+	memcpy(context.buffer, last_blocks[i - PIECE_MIN], 64);
+	SHA1_Transform(context.state, context.buffer);
+
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++) {
+		digest[i] = (uint8_t)
+			((context.state[i>>2] >> ((3-(i & 3)) * 8)) & 255);
+	}
+
+	return digest;
+}
+
 
 /*************************************************************\
  * Self Test                                                 *
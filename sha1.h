@@ -12,10 +12,15 @@ typedef struct {
 
 #define SHA_DIGEST_LENGTH 20
 
+struct iovec;
+
 #ifndef ALLINONE
 void SHA1_Init(SHA_CTX *context);
 void SHA1_Update(SHA_CTX *context, const uint8_t *data, unsigned long len);
+void SHA1_UpdateZeros(SHA_CTX *context, unsigned long len);
+void SHA1_UpdateV(SHA_CTX *context, const struct iovec *iov, int n);
 void SHA1_Final(uint8_t *digest, SHA_CTX *context);
+uint8_t *SHA1(const uint8_t *data, unsigned long len, uint8_t *digest);
 #endif
 
 #endif /* __SHA1_H */
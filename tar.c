@@ -0,0 +1,414 @@
+/*
+This file is part of mktorrent
+Copyright (C) 2009 Emil Renner Berthing
+
+mktorrent is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+mktorrent is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+*/
+#ifndef ALLINONE
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define EXPORT
+#endif /* ALLINONE */
+
+#include "tar.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined _LARGEFILE_SOURCE && defined O_LARGEFILE
+#define TAR_OPENFLAGS (O_RDONLY | O_BINARY | O_LARGEFILE)
+#else
+#define TAR_OPENFLAGS (O_RDONLY | O_BINARY)
+#endif
+
+/* a tar file is made of blocks of this size */
+#define TAR_BLOCK 512
+
+/* longest long name or pax extended header we read */
+#ifndef TAR_MAX_HEADER
+#define TAR_MAX_HEADER (1 << 20)
+#endif
+
+/*
+ * read len bytes at offset off of fd, or fewer when we hit the end.
+ * returns the number of bytes read, or -1 after saying what went wrong
+ */
+static ssize_t tar_read(int fd, const char *path, void *buf, size_t len,
+		off_t off)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t r = pread(fd, (char *) buf + done, len - done,
+				off + done);
+
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			fprintf(stderr, "Error reading from '%s': %s\n",
+					path, strerror(errno));
+			return -1;
+		}
+		if (r == 0)
+			break;
+		done += r;
+	}
+
+	return done;
+}
+
+/*
+ * a number in a header, in octal or, when it doesn't fit, in base 256
+ * with the top bit of the first byte set. returns -1 for numbers that
+ * are negative or too big, neither of which a size can be
+ */
+static int64_t tar_number(const unsigned char *p, size_t len)
+{
+	int64_t n = 0;
+
+	if (*p & 0x80) {
+		if (*p & 0x40)
+			return -1;
+		n = *p++ & 0x3F;
+		while (--len) {
+			if (n >> 55)
+				return -1;
+			n = n << 8 | *p++;
+		}
+		return n;
+	}
+
+	while (len && *p == ' ') {
+		p++;
+		len--;
+	}
+	for (; len && *p >= '0' && *p <= '7'; p++, len--)
+		n = n << 3 | (*p - '0');
+
+	return n;
+}
+
+/*
+ * the checksum is the sum of the bytes of the header with the
+ * checksum itself taken as spaces. some old tars summed signed bytes
+ */
+static int tar_checksum_ok(const unsigned char *h)
+{
+	int64_t want = tar_number(h + 148, 8);
+	int64_t sum = 0;
+	int64_t signed_sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < TAR_BLOCK; i++) {
+		unsigned char c = i >= 148 && i < 156 ? ' ' : h[i];
+
+		sum += c;
+		signed_sum += (signed char) c;
+	}
+
+	return want == sum || want == signed_sum;
+}
+
+/*
+ * whether a header is about the member following it
+ */
+static int tar_extended_type(unsigned char type)
+{
+	return type == 'x' || type == 'g' || type == 'L' || type == 'K';
+}
+
+/*
+ * the name in the header, with the prefix POSIX ustar headers
+ * have for long names in front of it
+ */
+static void tar_name(const unsigned char *h, char *name)
+{
+	size_t n = 0;
+	size_t i;
+
+	if (memcmp(h + 257, "ustar\0", 6) == 0 && h[345]) {
+		for (i = 345; i < 500 && h[i]; i++)
+			name[n++] = h[i];
+		name[n++] = '/';
+	}
+	for (i = 0; i < 100 && h[i]; i++)
+		name[n++] = h[i];
+	name[n] = '\0';
+}
+
+/*
+ * read the len bytes of a long name or pax extended header at offset
+ * off into a string, or return NULL after saying what went wrong
+ */
+static char *tar_extended(int fd, const char *path, int64_t len, off_t off)
+{
+	char *s;
+	ssize_t r;
+
+	if (len > TAR_MAX_HEADER) {
+		fprintf(stderr, "'%s' has a header of %" PRId64 " bytes "
+				"at offset %" PRIoff ", which is too long.\n",
+				path, len, off);
+		return NULL;
+	}
+
+	s = malloc(len + 1);
+	if (s == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return NULL;
+	}
+
+	r = tar_read(fd, path, s, len, off);
+	if (r < len) {
+		if (r >= 0)
+			fprintf(stderr, "'%s' ends in the middle of "
+					"a header.\n", path);
+		free(s);
+		return NULL;
+	}
+	s[len] = '\0';
+
+	return s;
+}
+
+/*
+ * pick what we want out of the "length key=value\n" records of a pax
+ * extended header: the path, link, size and modification time of the
+ * member following it, and whether that is a sparse file. *name and
+ * *link end up pointing into the header
+ */
+static void tar_pax(char *p, char **name, char **link, int64_t *size,
+		int64_t *mtime, int *sparse)
+{
+	char *end = p + strlen(p);
+
+	while (p < end) {
+		char *rec = p;
+		char *key;
+		char *eq;
+		long n = strtol(rec, &key, 10);
+
+		if (n <= 0 || n > end - rec || *key != ' ')
+			break;
+		key++;
+		p = rec + n;
+		if (p[-1] != '\n' || (eq = memchr(key, '=', p - key)) == NULL)
+			continue;
+		*eq = '\0';
+		p[-1] = '\0';
+
+		if (strcmp(key, "path") == 0)
+			*name = eq + 1;
+		else if (strcmp(key, "linkpath") == 0)
+			*link = eq + 1;
+		else if (strcmp(key, "size") == 0)
+			*size = strtoll(eq + 1, NULL, 10);
+		else if (strcmp(key, "mtime") == 0)
+			*mtime = strtoll(eq + 1, NULL, 10);
+		else if (strncmp(key, "GNU.sparse.", 11) == 0)
+			*sparse = 1;
+	}
+}
+
+/*
+ * call callback with the name, the name of the member it is a hard link
+ * to if it is one, a stat structure filled out from the header, and the
+ * offset of the contents of every member of the tar file at path,
+ * reading nothing but the headers. returns 0 when done, or 1 if the tar
+ * file is damaged or the callback returns non-zero
+ */
+EXPORT int tar_walk(const char *path, tar_walk_cb callback, void *data)
+{
+	unsigned char h[TAR_BLOCK];
+	char name[257];            /* prefix, '/', name and '\0' */
+	char link[101];
+	char *long_name = NULL;    /* from GNU long name headers */
+	char *long_link = NULL;
+	char *pax = NULL;          /* a pax extended header */
+	char *pax_name = NULL;     /* ..and what it says */
+	char *pax_link = NULL;
+	int64_t pax_size = -1;
+	int64_t pax_mtime = -1;
+	int sparse = 0;
+	struct stat st;
+	off_t off = 0;
+	int fd;
+	int ret = 1;
+
+	fd = open(path, TAR_OPENFLAGS);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening '%s' for reading: %s\n",
+				path, strerror(errno));
+		return 1;
+	}
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "Error stat'ing '%s': %s\n",
+				path, strerror(errno));
+		goto out;
+	}
+
+	for (;;) {
+		struct stat member;
+		const char *skip = NULL;
+		const char *n;
+		const char *l = NULL;
+		int64_t size;
+		off_t next;
+		ssize_t r = tar_read(fd, path, h, TAR_BLOCK, off);
+		ssize_t i;
+
+		if (r < 0)
+			goto out;
+
+		/* the end is marked by blocks of zeros,
+		   which some leave out */
+		for (i = 0; i < r && h[i] == 0; i++);
+		if (i == r)
+			break;
+
+		if (r < TAR_BLOCK || !tar_checksum_ok(h)) {
+			fprintf(stderr, "'%s' is not a tar file, or it is "
+					"damaged at offset %" PRIoff ".\n",
+					path, off);
+			goto out;
+		}
+
+		size = tar_number(h + 124, 12);
+		if (pax_size >= 0 && !tar_extended_type(h[156]))
+			size = pax_size;
+		if (size < 0 || size > st.st_size - off - TAR_BLOCK) {
+			fprintf(stderr, "'%s' ends in the middle of the member "
+					"at offset %" PRIoff ".\n", path, off);
+			goto out;
+		}
+		next = off + TAR_BLOCK
+			+ (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+
+		switch (h[156]) {
+		case 'L':
+			free(long_name);
+			long_name = tar_extended(fd, path, size,
+					off + TAR_BLOCK);
+			if (long_name == NULL)
+				goto out;
+			off = next;
+			continue;
+		case 'K':
+			free(long_link);
+			long_link = tar_extended(fd, path, size,
+					off + TAR_BLOCK);
+			if (long_link == NULL)
+				goto out;
+			off = next;
+			continue;
+		case 'x':
+			free(pax);
+			pax = tar_extended(fd, path, size, off + TAR_BLOCK);
+			if (pax == NULL)
+				goto out;
+			tar_pax(pax, &pax_name, &pax_link, &pax_size,
+					&pax_mtime, &sparse);
+			off = next;
+			continue;
+		case 'g':
+			/* global headers tell us nothing we need */
+			off = next;
+			continue;
+		}
+
+		tar_name(h, name);
+		memset(&member, 0, sizeof(member));
+		member.st_dev = st.st_dev;
+		member.st_size = size;
+		/* the contents are all there, without holes */
+		member.st_blocks = (size + TAR_BLOCK - 1) / TAR_BLOCK;
+		member.st_mtime = pax_mtime >= 0 ? pax_mtime
+			: tar_number(h + 136, 12);
+
+		switch (h[156]) {
+		case '0':
+		case '\0':
+		case '7':
+			if (sparse)
+				skip = "a sparse file";
+			else
+				member.st_mode = S_IFREG;
+			break;
+		case '5':
+			member.st_mode = S_IFDIR;
+			member.st_size = 0;
+			break;
+		case '1':
+			/* extracted, it is a copy of the member it links to */
+			member.st_mode = S_IFREG;
+			if (pax_link)
+				l = pax_link;
+			else if (long_link)
+				l = long_link;
+			else {
+				memcpy(link, h + 157, 100);
+				link[100] = '\0';
+				l = link;
+			}
+			break;
+		case '2':
+			skip = "a symbolic link";
+			break;
+		case 'S':
+			skip = "a sparse file";
+			break;
+		}
+
+		/* pax names win over GNU long names, which win over
+		   the name in the header */
+		if (pax_name)
+			n = pax_name;
+		else if (long_name)
+			n = long_name;
+		else
+			n = name;
+
+		if (skip)
+			fprintf(stderr, "Warning: Skipping '%s', which is %s "
+				"in the tar file.\n", n, skip);
+		else if (callback(n, l, &member, off + TAR_BLOCK, data))
+			goto out;
+
+		free(long_name);
+		free(long_link);
+		free(pax);
+		long_name = long_link = pax = pax_name = pax_link = NULL;
+		pax_size = pax_mtime = -1;
+		sparse = 0;
+		off = next;
+	}
+
+	ret = 0;
+out:
+	free(long_name);
+	free(long_link);
+	free(pax);
+	close(fd);
+	return ret;
+}
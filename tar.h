@@ -0,0 +1,11 @@
+#ifndef _TAR_H
+#define _TAR_H
+
+typedef int (*tar_walk_cb)(const char *name, const char *link,
+		const struct stat *sbuf, off_t offset, void *data);
+
+#ifndef ALLINONE
+int tar_walk(const char *path, tar_walk_cb callback, void *data);
+#endif /* ALLINONE */
+
+#endif /* _TAR_H */
@@ -0,0 +1,44 @@
+#!/bin/sh
+# This file is part of mktorrent
+# Copyright (C) 2007, 2009 Emil Renner Berthing
+#
+# mktorrent is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# mktorrent is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+# check.sh, run by 'make check'
+#
+# build a serial and a threaded mktorrent with the options make passes
+# on in the environment, and run the tests against them
+
+cd "`dirname "$0"`/.." || exit 1
+tests=`pwd`/tests
+
+work=`mktemp -d "${TMPDIR:-/tmp}/mktorrent-check.XXXXXX"` || exit 1
+trap 'rm -rf "$work"' 0
+trap 'exit 1' 1 2 15
+
+# the make running us would pass its command line on to ours,
+# and the options we weren't given must not be set at all
+unset MAKEFLAGS MFLAGS NO_PTHREADS
+for v in USE_OPENSSL USE_IO_URING USE_LONG_OPTIONS USE_LARGE_FILES; do
+	eval "[ -n \"\$$v\" ] || unset $v"
+done
+
+${MAKE:-make} -s allinone NO_PTHREADS=1 program="$work/serial" || exit 1
+${MAKE:-make} -s allinone program="$work/threaded" || exit 1
+
+fail=0
+sh "$tests/threads.sh" "$work/serial" "$work/threaded" "$work" || fail=1
+sh "$tests/io.sh" "$work" "$work/serial" "$work/threaded" || fail=1
+exit $fail
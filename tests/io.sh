@@ -0,0 +1,79 @@
+#!/bin/sh
+# This file is part of mktorrent
+# Copyright (C) 2007, 2009 Emil Renner Berthing
+#
+# mktorrent is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# mktorrent is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+# io.sh <work dir> <mktorrent>..
+#
+# hash the same tree with every -I method of every mktorrent given,
+# io_uring too where it is built in, and check that they all make the
+# same metainfo file. the tree has a file whose size isn't a multiple
+# of what O_DIRECT reads, and a sparse file whose holes are hashed as
+# zeros without reading them
+
+. "`dirname "$0"`/tree.sh"
+
+work=$1
+shift
+tree=$work/io
+fail=0
+
+rm -rf "$tree"
+make_tree "$tree" 7
+head -c 200001 /dev/urandom > "$tree/unaligned" || exit 1
+
+# some data, a hole of many pieces, a little more data and a hole at
+# the end, which the file system may not store as holes
+head -c 5000 /dev/urandom > "$tree/sparse" || exit 1
+dd if=/dev/urandom of="$tree/sparse" bs=1024 seek=400 count=3 \
+	conv=notrunc 2> /dev/null || exit 1
+dd if=/dev/null of="$tree/sparse" bs=1024 seek=700 2> /dev/null || exit 1
+
+for opts in "-l 15" "-l 17 -P"; do
+	ref=
+
+	for mktorrent in "$@"; do
+		methods="read pread direct mmap"
+		if "$mktorrent" -h | grep io_uring > /dev/null; then
+			methods="$methods io_uring"
+		fi
+
+		for io in $methods; do
+			rm -f "$work/io.torrent"
+			if ! "$mktorrent" -d $opts -I $io \
+					-o "$work/io.torrent" "$tree" \
+					> "$work/log" 2>&1; then
+				cat "$work/log"
+				echo "FAIL: $mktorrent $opts -I $io"
+				fail=1
+				continue
+			fi
+
+			if [ -z "$ref" ]; then
+				ref="$mktorrent $opts -I $io"
+				mv "$work/io.torrent" "$work/ref.torrent"
+			elif ! cmp "$work/io.torrent" "$work/ref.torrent" \
+					> /dev/null; then
+				echo "FAIL: $mktorrent $opts -I $io" \
+					"differs from $ref"
+				fail=1
+			fi
+		done
+	done
+done
+
+[ $fail = 0 ] && echo "ok: every -I method makes the same metainfo"
+exit $fail
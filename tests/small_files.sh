@@ -0,0 +1,110 @@
+#!/bin/sh
+# This file is part of mktorrent
+# Copyright (C) 2007, 2009 Emil Renner Berthing
+#
+# mktorrent is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# mktorrent is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+# small_files.sh, run by 'make bench'
+#
+# time hashing a tree of FILES (a million by default) files below 4 KB,
+# a thousand to a directory, with the serial and the threaded build,
+# reading the files one at a time (SMALL_FILE=0), in batches, and in
+# batches through io_uring where it builds. the best of RUNS runs is
+# shown, with the files in the page cache, so it is the system calls
+# we time. TREE keeps the tree there for the next time
+
+cd "`dirname "$0"`/.." || exit 1
+
+files=${FILES:-1000000}
+runs=${RUNS:-3}
+
+work=`mktemp -d "${TMPDIR:-/tmp}/mktorrent-bench.XXXXXX"` || exit 1
+trap 'rm -rf "$work"' 0
+trap 'exit 1' 1 2 15
+
+unset MAKEFLAGS MFLAGS NO_PTHREADS USE_IO_URING
+for v in USE_OPENSSL USE_LONG_OPTIONS USE_LARGE_FILES; do
+	eval "[ -n \"\$$v\" ] || unset $v"
+done
+
+# build <name> <make arguments>..
+build()
+{
+	name=$1
+	shift
+	${MAKE:-make} -s allinone program="$work/$name" "$@" > /dev/null
+}
+
+build serial-single NO_PTHREADS=1 CFLAGS="${CFLAGS:--O2} -DSMALL_FILE=0" \
+	|| exit 1
+build serial-batched NO_PTHREADS=1 || exit 1
+build threaded-single CFLAGS="${CFLAGS:--O2} -DSMALL_FILE=0" || exit 1
+build threaded-batched || exit 1
+variants="serial-single serial-batched threaded-single threaded-batched"
+if build serial-io_uring NO_PTHREADS=1 USE_IO_URING=1 2> /dev/null &&
+		build threaded-io_uring USE_IO_URING=1 2> /dev/null; then
+	variants="$variants serial-io_uring threaded-io_uring"
+fi
+
+tree=${TREE:-$work/tree}
+if [ ! -d "$tree" ]; then
+	echo "Making $files files in $tree"
+	mkdir -p "$tree" || exit 1
+	awk -v n="$files" -v tree="$tree" 'BEGIN {
+		for (i = 0; i * 1000 < n; i++)
+			print tree "/" i
+	}' | xargs mkdir || exit 1
+	awk -v n="$files" -v tree="$tree" 'BEGIN {
+		srand(1)
+		for (i = 0; i < 4096; i++)
+			pool = pool sprintf("%c", 32 + int(rand() * 95))
+		for (i = 0; i < n; i++) {
+			path = tree "/" int(i / 1000) "/f" i
+			printf "%s", substr(pool, 1 + int(rand() * 96),
+				int(rand() * 4000)) > path
+			close(path)
+		}
+	}' || exit 1
+fi
+
+# seconds since the epoch, with the fraction where date knows it
+now()
+{
+	t=`date +%s.%N`
+	case $t in
+	*N) date +%s ;;
+	*) echo "$t" ;;
+	esac
+}
+
+for v in $variants; do
+	best=
+	i=0
+	while [ $i -lt $runs ]; do
+		rm -f "$work/out.torrent"
+		start=`now`
+		"$work/$v" -d -l 20 -o "$work/out.torrent" "$tree" \
+			> /dev/null || exit 1
+		end=`now`
+		best=`echo "$start $end $best" | awk '{
+			t = $2 - $1
+			if ($3 != "" && $3 < t)
+				t = $3
+			printf "%.2f", t
+		}'`
+		i=`expr $i + 1`
+	done
+	printf "%-20s %8s s\n" "$v" "$best"
+done
@@ -0,0 +1,84 @@
+#!/bin/sh
+# This file is part of mktorrent
+# Copyright (C) 2007, 2009 Emil Renner Berthing
+#
+# mktorrent is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# mktorrent is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+# threads.sh <serial mktorrent> <threaded mktorrent> <work dir>
+#
+# hash random trees with the serial and the threaded hasher, the latter
+# with one thread, several and -C too, and check that they make the
+# same metainfo files byte for byte. SEEDS picks the trees
+
+. "`dirname "$0"`/tree.sh"
+
+serial=$1
+threaded=$2
+work=$3
+fail=0
+
+# make the metainfo files of the tree with the options given with
+# both hashers and compare them. with several piece lengths there is
+# a metainfo file for each
+same()
+{
+	rm -f "$work"/s*.torrent
+	if ! "$serial" -d "$@" -o "$work/s.torrent" "$work/tree" \
+			> "$work/log" 2>&1; then
+		cat "$work/log"
+		echo "FAIL: serial $*"
+		fail=1
+		return
+	fi
+
+	for t in "-t 4" "-t 1" "-C"; do
+		rm -f "$work"/t*.torrent
+		if ! "$threaded" -d $t "$@" -o "$work/t.torrent" \
+				"$work/tree" > "$work/log" 2>&1; then
+			cat "$work/log"
+			echo "FAIL: threaded $t $*"
+			fail=1
+			continue
+		fi
+
+		for s in "$work"/s*.torrent; do
+			if ! cmp "$s" "$work/t${s#$work/s}" > /dev/null; then
+				echo "FAIL: seed $seed, $t $*:" \
+					"${s#$work/} differs"
+				fail=1
+			fi
+		done
+	done
+}
+
+for seed in ${SEEDS:-1 2 3 4 5 6}; do
+	rm -rf "$work/tree" "$work/cache"
+	make_tree "$work/tree" "$seed"
+	l=`expr 15 + $seed % 6`
+
+	same -l $l
+	same -l $l -P
+	same -l $l -x '*.txt'
+	same -l $l -i '*.mkv' -x b
+	same -l 15,17,20
+	same -l 16,18 -x '*.nfo'
+
+	# the first run fills the cache, the second reuses what is in it
+	same -l $l -H "$work/cache"
+	same -l $l -H "$work/cache"
+done
+
+[ $fail = 0 ] && echo "ok: serial and threaded hashers agree"
+exit $fail
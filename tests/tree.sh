@@ -0,0 +1,48 @@
+# This file is part of mktorrent
+# Copyright (C) 2007, 2009 Emil Renner Berthing
+#
+# mktorrent is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# mktorrent is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA
+
+# make_tree <dir> <seed>
+#
+# fill dir with a random tree of up to 200 files, in up to three
+# levels of directories named a, b and c. the files are empty, smaller
+# than a piece or span several of them, end in .mkv, .txt or .nfo, and
+# one of them has a hard link, so its pieces are reused
+make_tree()
+{
+	mkdir -p "$1" || exit 1
+	awk -v seed="$2" 'BEGIN {
+		srand(seed)
+		split("0 1 100 5000 40000 70000 300000 1100000", size)
+		split("mkv txt nfo", ext)
+		n = 1 + int(rand() * 200)
+		for (i = 0; i < n; i++) {
+			dir = "."
+			for (j = int(rand() * 4); j > 0; j--)
+				dir = dir "/" substr("abc", 1 + int(rand() * 3), 1)
+			print dir, "f" i "." ext[1 + int(rand() * 3)],
+				size[1 + int(rand() * 8)]
+		}
+	}' | while read -r dir name size; do
+		mkdir -p "$1/$dir" &&
+			head -c "$size" /dev/urandom > "$1/$dir/$name" || exit 1
+	done || exit 1
+
+	link=`find "$1" -type f -size +100 | head -n 1`
+	if [ -n "$link" ]; then
+		ln "$link" "$1/link.mkv" || exit 1
+	fi
+}